@@ -1,6 +1,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <poll.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+#define HAVE_JIT 1
+#endif
 
 #define MEMORY_SIZE 256
 #define OP_NOP  0x00  // 00000000
@@ -31,17 +50,144 @@ void init_vm(NeanderVM *vm) {
     vm->Z = 0;
 }
 
+// Memory image formats understood by read_image
+typedef enum {
+    IMAGE_RAW,          // Plain bytes, as written by --batch tools and tests
+    IMAGE_BITS,         // One byte per line as eight '0'/'1' chars (assembler.c)
+    IMAGE_NEANDER       // 0x4e03 0x5244 header, then 16-bit words (neander_converter.c)
+} ImageFormat;
+
+const char *image_format_names[] = { "raw", "ASCII bits", "Neander" };
+
+#define IMAGE_MAX_FILE (MEMORY_SIZE * 10)  // CRLF bit lines; only this much is read
+#define SWAR_ONES 0x0101010101010101ULL
+
+// Decode one line of eight '0'/'1' chars into a byte, eight chars at a time:
+// each char is 0x30 or 0x31, so after checking that, the low bits are the
+// data and one multiply gathers them into the top byte, first char highest.
+// Returns -1 if the chars are not all '0' or '1'.
+static inline int parse_bit_line(const unsigned char *line) {
+    unsigned long long x;
+    memcpy(&x, line, sizeof(x));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    if ((x & ~SWAR_ONES) != 0x30 * SWAR_ONES) {
+        return -1;
+    }
+    return (int)(((x & SWAR_ONES) * 0x8040201008040201ULL) >> 56);
+}
+
+// Decode an ASCII bit-line image into memory; returns the number of bytes
+// decoded or -1 if the data is not in that format
+long decode_bit_lines(unsigned char *memory, const unsigned char *data, size_t size) {
+    unsigned char bytes[MEMORY_SIZE];
+    size_t stride;
+    
+    if (size >= 9 && data[8] == '\n') {
+        stride = 9;
+    } else if (size >= 10 && data[8] == '\r' && data[9] == '\n') {
+        stride = 10;
+    } else {
+        return -1;
+    }
+    // The last line may lack its newline
+    size_t lines = size / stride + (size % stride == 8);
+    if (size % stride != 0 && size % stride != 8) {
+        return -1;
+    }
+    if (lines > MEMORY_SIZE) {
+        lines = MEMORY_SIZE;
+    }
+    for (size_t i = 0; i < lines; i++) {
+        const unsigned char *line = data + i * stride;
+        int value = parse_bit_line(line);
+        if (value < 0 || (i * stride + 8 < size && line[stride - 1] != '\n')) {
+            return -1;
+        }
+        bytes[i] = value;
+    }
+    memcpy(memory, bytes, lines);
+    return lines;
+}
+
+// Decode an image in any supported format into memory; returns the number
+// of memory bytes loaded
+long decode_image(unsigned char *memory, const unsigned char *data, size_t size,
+                  ImageFormat *format) {
+    static const unsigned char neander_header[4] = { 0x03, 0x4E, 0x44, 0x52 };
+    
+    if (size >= 4 && memcmp(data, neander_header, 4) == 0) {
+        // Little-endian words; only the low byte of each is addressable
+        size_t words = (size - 4) / 2;
+        if (words > MEMORY_SIZE) {
+            words = MEMORY_SIZE;
+        }
+        for (size_t i = 0; i < words; i++) {
+            memory[i] = data[4 + 2 * i];
+        }
+        *format = IMAGE_NEANDER;
+        return words;
+    }
+    long lines = decode_bit_lines(memory, data, size);
+    if (lines >= 0) {
+        *format = IMAGE_BITS;
+        return lines;
+    }
+    if (size > MEMORY_SIZE) {
+        size = MEMORY_SIZE;
+    }
+    memcpy(memory, data, size);
+    *format = IMAGE_RAW;
+    return size;
+}
+
+// Read a memory image in any supported format; returns the number of
+// memory bytes loaded or -1. Regular files are mapped rather than read.
+long read_image_format(NeanderVM *vm, const char *filename, ImageFormat *format) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    struct stat st;
+    long loaded = -1;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        size_t size = st.st_size < IMAGE_MAX_FILE ? (size_t)st.st_size : IMAGE_MAX_FILE;
+        void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            loaded = decode_image(vm->memory, data, size, format);
+            munmap(data, size);
+        }
+    } else {
+        // Pipes, devices and empty files
+        unsigned char data[IMAGE_MAX_FILE];
+        size_t size = 0;
+        ssize_t n;
+        while (size < sizeof(data) &&
+               (n = read(fd, data + size, sizeof(data) - size)) > 0) {
+            size += n;
+        }
+        loaded = decode_image(vm->memory, data, size, format);
+    }
+    close(fd);
+    return loaded;
+}
+
+long read_image(NeanderVM *vm, const char *filename) {
+    ImageFormat format;
+    return read_image_format(vm, filename, &format);
+}
+
 void load_program(NeanderVM *vm, const char *filename) {
-    FILE *file = fopen(filename, "rb");
-    if (!file) {
+    ImageFormat format;
+    long bytes_read = read_image_format(vm, filename, &format);
+    if (bytes_read < 0) {
         fprintf(stderr, "Error: Cannot open input file %s\n", filename);
         exit(1);
     }
     
-    size_t bytes_read = fread(vm->memory, 1, MEMORY_SIZE, file);
-    printf("Loaded %zu bytes from %s\n", bytes_read, filename);
-    
-    fclose(file);
+    printf("Loaded %ld bytes from %s (%s)\n", bytes_read, filename, image_format_names[format]);
 }
 
 void update_flags(NeanderVM *vm) {
@@ -68,74 +214,81 @@ void dump_memory(NeanderVM *vm, int start, int end) {
     printf("\n");
 }
 
-int execute_instruction(NeanderVM *vm) {
-    unsigned char opcode = vm->memory[vm->PC] & 0xF0;  // Higher 4 bits
-    unsigned char operand;
+// Print the instruction at PC in the same format used by the step trace
+void print_instruction(NeanderVM *vm) {
+    unsigned char opcode = vm->memory[vm->PC] & 0xF0;
+    unsigned char operand = vm->memory[(unsigned char)(vm->PC + 1)];
     
-    // Print current instruction
     printf("Executing at PC=%02X: ", vm->PC);
     
+    switch (opcode) {
+        case OP_NOP: printf("NOP\n"); break;
+        case OP_STA: printf("STA %02X\n", operand); break;
+        case OP_LDA: printf("LDA %02X\n", operand); break;
+        case OP_ADD: printf("ADD %02X\n", operand); break;
+        case OP_OR:  printf("OR %02X\n", operand); break;
+        case OP_AND: printf("AND %02X\n", operand); break;
+        case OP_NOT: printf("NOT\n"); break;
+        case OP_JMP: printf("JMP %02X\n", operand); break;
+        case OP_JN:  printf("JN %02X\n", operand); break;
+        case OP_JZ:  printf("JZ %02X\n", operand); break;
+        case OP_HLT: printf("HLT\n"); break;
+        default:     printf("Unknown opcode: %02X\n", opcode); break;
+    }
+}
+
+// Execute one instruction without any I/O. This is the reference
+// implementation every other engine is checked against.
+// The operand byte of an instruction at 0xFF wraps around to address 0x00.
+int step_vm(NeanderVM *vm) {
+    unsigned char opcode = vm->memory[vm->PC] & 0xF0;  // Higher 4 bits
+    unsigned char operand = vm->memory[(unsigned char)(vm->PC + 1)];
+    
     switch (opcode) {
         case OP_NOP:
-            printf("NOP\n");
             vm->PC++;
             break;
             
         case OP_STA:
-            operand = vm->memory[vm->PC + 1];
-            printf("STA %02X\n", operand);
             vm->memory[operand] = vm->accumulator;
             vm->PC += 2;
             break;
             
         case OP_LDA:
-            operand = vm->memory[vm->PC + 1];
-            printf("LDA %02X\n", operand);
             vm->accumulator = vm->memory[operand];
             update_flags(vm);
             vm->PC += 2;
             break;
             
         case OP_ADD:
-            operand = vm->memory[vm->PC + 1];
-            printf("ADD %02X\n", operand);
             vm->accumulator += vm->memory[operand];
             update_flags(vm);
             vm->PC += 2;
             break;
             
         case OP_OR:
-            operand = vm->memory[vm->PC + 1];
-            printf("OR %02X\n", operand);
             vm->accumulator |= vm->memory[operand];
             update_flags(vm);
             vm->PC += 2;
             break;
             
         case OP_AND:
-            operand = vm->memory[vm->PC + 1];
-            printf("AND %02X\n", operand);
             vm->accumulator &= vm->memory[operand];
             update_flags(vm);
             vm->PC += 2;
             break;
             
         case OP_NOT:
-            printf("NOT\n");
             vm->accumulator = ~vm->accumulator;
             update_flags(vm);
             vm->PC++;
             break;
             
         case OP_JMP:
-            operand = vm->memory[vm->PC + 1];
-            printf("JMP %02X\n", operand);
             vm->PC = operand;
             break;
             
         case OP_JN:
-            operand = vm->memory[vm->PC + 1];
-            printf("JN %02X\n", operand);
             if (vm->N) {
                 vm->PC = operand;
             } else {
@@ -144,8 +297,6 @@ int execute_instruction(NeanderVM *vm) {
             break;
             
         case OP_JZ:
-            operand = vm->memory[vm->PC + 1];
-            printf("JZ %02X\n", operand);
             if (vm->Z) {
                 vm->PC = operand;
             } else {
@@ -154,11 +305,9 @@ int execute_instruction(NeanderVM *vm) {
             break;
             
         case OP_HLT:
-            printf("HLT\n");
             return 0;  // Signal to stop execution
             
         default:
-            printf("Unknown opcode: %02X\n", opcode);
             vm->PC++;
             break;
     }
@@ -166,79 +315,5061 @@ int execute_instruction(NeanderVM *vm) {
     return 1;  // Continue execution
 }
 
-void run(NeanderVM *vm, int max_steps, int verbose) {
-    int steps = 0;
-    int running = 1;
+int execute_instruction(NeanderVM *vm) {
+    // Print current instruction
+    print_instruction(vm);
     
-    printf("Starting execution...\n");
+    return step_vm(vm);
+}
+
+// Loop idioms emitted by the compiler for '*' and '/' (see
+// generate_multiplication and generate_division in main.c). Both run one
+// iteration per unit of an operand, so the threaded engine replaces a whole
+// run of the loop with its closed-form result.
+typedef enum {
+    IDIOM_NONE,
+    IDIOM_MUL,      // result += operand, counter -= 1 until counter == 0
+    IDIOM_DIV       // remainder -= divisor, result += 1 until divisor - remainder < 0
+} IdiomKind;
+
+typedef struct {
+    IdiomKind kind;
+    unsigned char counter;      // Loop counter (MUL) or remainder (DIV)
+    unsigned char result;
+    unsigned char operand;      // Added operand (MUL) or divisor (DIV)
+    unsigned char constant;     // Address holding -1 (MUL) or 1 (DIV)
+    unsigned char exit;
+} LoopIdiom;
+
+int accelerate_idioms = 1;      // Cleared by --no-idioms
+
+#define MUL_IDIOM_SIZE 18
+#define DIV_IDIOM_SIZE 29
+
+// Match 'opcode operand' at pc + offset, capturing or checking the operand.
+// A slot of -1 captures; otherwise the operand must equal the slot.
+int idiom_op(const unsigned char *mem, unsigned char pc, int offset,
+             unsigned char opcode, int *slot) {
+    unsigned char at = pc + offset;
+    if ((mem[at] & 0xF0) != opcode) {
+        return 0;
+    }
+    if (slot) {
+        unsigned char operand = mem[(unsigned char)(at + 1)];
+        if (*slot < 0) {
+            *slot = operand;
+        } else if (*slot != operand) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Is addr one of the 'size' bytes of code starting at pc?
+int idiom_covers(unsigned char pc, int size, unsigned char addr) {
+    return (unsigned char)(addr - pc) < size;
+}
+
+// Recognize a multiply or divide loop starting at pc. Only the exact shapes
+// the compiler generates are accepted, and only when the loop's stores hit
+// nothing but its own counter and result slots: not its own code, not the
+// operands it reads.
+int match_idiom(const unsigned char *mem, unsigned char pc, LoopIdiom *idiom) {
+    int counter = -1, result = -1, operand = -1, constant = -1, exit = -1, loop = pc;
     
-    while (running && (max_steps == 0 || steps < max_steps)) {
-        if (verbose) {
-            print_state(vm);
+    if (idiom_op(mem, pc, 0, OP_LDA, &counter) &&
+        idiom_op(mem, pc, 2, OP_JZ, &exit) &&
+        idiom_op(mem, pc, 4, OP_LDA, &result) &&
+        idiom_op(mem, pc, 6, OP_ADD, &operand) &&
+        idiom_op(mem, pc, 8, OP_STA, &result) &&
+        idiom_op(mem, pc, 10, OP_LDA, &counter) &&
+        idiom_op(mem, pc, 12, OP_ADD, &constant) &&
+        idiom_op(mem, pc, 14, OP_STA, &counter) &&
+        idiom_op(mem, pc, 16, OP_JMP, &loop) &&
+        mem[constant] == 0xFF &&
+        !idiom_covers(pc, MUL_IDIOM_SIZE, counter) &&
+        !idiom_covers(pc, MUL_IDIOM_SIZE, result)) {
+        idiom->kind = IDIOM_MUL;
+    } else if (counter = -1, result = -1, operand = -1, constant = -1, exit = -1,
+               idiom_op(mem, pc, 0, OP_LDA, &counter) &&
+               idiom_op(mem, pc, 2, OP_NOT, NULL) &&
+               idiom_op(mem, pc, 3, OP_ADD, &operand) &&
+               idiom_op(mem, pc, 5, OP_ADD, &constant) &&
+               idiom_op(mem, pc, 7, OP_JN, &exit) &&
+               idiom_op(mem, pc, 9, OP_LDA, &counter) &&
+               idiom_op(mem, pc, 11, OP_NOT, NULL) &&
+               idiom_op(mem, pc, 12, OP_ADD, &constant) &&
+               idiom_op(mem, pc, 14, OP_ADD, &operand) &&
+               idiom_op(mem, pc, 16, OP_NOT, NULL) &&
+               idiom_op(mem, pc, 17, OP_ADD, &constant) &&
+               idiom_op(mem, pc, 19, OP_STA, &counter) &&
+               idiom_op(mem, pc, 21, OP_LDA, &result) &&
+               idiom_op(mem, pc, 23, OP_ADD, &constant) &&
+               idiom_op(mem, pc, 25, OP_STA, &result) &&
+               idiom_op(mem, pc, 27, OP_JMP, &loop) &&
+               mem[constant] == 1 &&
+               !idiom_covers(pc, DIV_IDIOM_SIZE, counter) &&
+               !idiom_covers(pc, DIV_IDIOM_SIZE, result)) {
+        idiom->kind = IDIOM_DIV;
+    } else {
+        return 0;
+    }
+    
+    if (counter == result || operand == counter || operand == result ||
+        constant == counter || constant == result) {
+        return 0;
+    }
+    idiom->counter = counter;
+    idiom->result = result;
+    idiom->operand = operand;
+    idiom->constant = constant;
+    idiom->exit = exit;
+    return 1;
+}
+
+// Run the idiom at vm->PC to its exit in one go, leaving exactly the state
+// the interpreter would. Returns the steps that took (0 if the loop does not
+// finish within 'budget' steps or would not iterate at all) and stores the
+// number of loop iterations in *iterations.
+long run_idiom(NeanderVM *vm, const LoopIdiom *idiom, long budget, long *iterations) {
+    unsigned char *mem = vm->memory;
+    long steps;
+    
+    if (idiom->kind == IDIOM_MUL) {
+        // 9 instructions per iteration, then LDA + JZ to leave
+        unsigned char count = mem[idiom->counter];
+        steps = 9L * count + 2;
+        if (count == 0 || steps > budget) {
+            return 0;
+        }
+        mem[idiom->result] += (unsigned char)(count * mem[idiom->operand]);
+        mem[idiom->counter] = 0;
+        vm->accumulator = 0;
+        *iterations = count;
+    } else {
+        // 16 instructions per iteration, then LDA, NOT, ADD, ADD, JN to leave.
+        // The remainder is the only state the loop carries, so it exits
+        // within 256 iterations or never.
+        unsigned char divisor = mem[idiom->operand];
+        unsigned char remainder = mem[idiom->counter];
+        long count = 0;
+        while (!((unsigned char)(divisor - remainder) & 0x80)) {
+            remainder -= divisor;
+            if (++count == MEMORY_SIZE) {
+                return 0;
+            }
+        }
+        steps = 16 * count + 5;
+        if (count == 0 || steps > budget) {
+            return 0;
+        }
+        mem[idiom->result] += (unsigned char)count;
+        mem[idiom->counter] = remainder;
+        vm->accumulator = divisor - remainder;
+        *iterations = count;
+    }
+    update_flags(vm);
+    vm->PC = idiom->exit;
+    return steps;
+}
+
+// Execution profile collected by the threaded engine. Indexed by address,
+// except 'opcodes', which is indexed by the opcode's high nibble.
+typedef struct {
+    unsigned long long exec[MEMORY_SIZE];       // Instructions executed at each PC
+    unsigned long long taken[MEMORY_SIZE];      // JN/JZ that jumped
+    unsigned long long not_taken[MEMORY_SIZE];  // JN/JZ that fell through
+    unsigned long long reads[MEMORY_SIZE];      // Operand reads by LDA/ADD/OR/AND
+    unsigned long long writes[MEMORY_SIZE];     // Stores by STA
+    unsigned long long opcodes[16];
+} Profile;
+
+const char *opcode_names[16] = {
+    "NOP", "STA", "LDA", "ADD", "OR", "AND", "NOT", "OP7",
+    "JMP", "JN", "JZ", "OPB", "OPC", "OPD", "OPE", "HLT"
+};
+
+// Clock cycles per instruction on the reference Neander datapath: every
+// memory access takes a read/transfer pair on top of the three fetch/decode
+// states. JN/JZ are listed with their not-taken cost; a taken branch also
+// reads its operand and costs BRANCH_TAKEN_CYCLES.
+const unsigned char opcode_cycles[16] = {
+    4, 8, 8, 8, 8, 8, 4, 4,     // NOP STA LDA ADD OR AND NOT -
+    6, 4, 4, 4, 4, 4, 4, 4      // JMP JN JZ - - - - HLT
+};
+#define BRANCH_TAKEN_CYCLES 6
+#define MAX_INSTRUCTION_CYCLES 8
+
+// Binary execution trace. A trace file starts with a header holding the
+// initial machine state, followed by compressed chunks of step records:
+//   "NTRC" version(1) 0 0 0 memory[256] AC PC N Z
+//   then per chunk: raw length (u32 LE), compressed length (u32 LE), data
+// Each step is one record: a tag byte, then the new PC for jumps, the AC
+// delta and the written address/value, as the tag says. Records never
+// straddle chunks, so every chunk decodes on its own.
+#define TRACE_MAGIC "NTRC"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE (8 + MEMORY_SIZE + 4)
+#define TRACE_CHUNK_SIZE 65536
+#define TRACE_MAX_RECORD 8
+#define TRACE_POOL_CHUNKS 16
+
+#define TRACE_PC_MASK   0x03
+#define TRACE_PC_NEXT2  0x00    // PC advanced past a two-byte instruction
+#define TRACE_PC_NEXT1  0x01    // PC advanced past a one-byte instruction
+#define TRACE_PC_JUMP   0x02    // New PC follows
+#define TRACE_PC_STAY   0x03    // HLT
+#define TRACE_AC        0x04    // AC delta follows; flags follow the new AC
+#define TRACE_FLAGS     0x08    // Flags recomputed from an unchanged AC
+#define TRACE_WRITE     0x10    // Address and value of a store follow
+
+typedef struct TraceChunk {
+    unsigned char data[TRACE_CHUNK_SIZE];
+    size_t used;
+    struct TraceWriter *writer;
+    int close;                  // Last item for its writer: close the file
+    struct TraceChunk *next;
+} TraceChunk;
+
+// Compresses and writes chunks on a background thread, in submission
+// order, for any number of writers. Chunks come from a fixed pool; a
+// producer that outruns the disk waits for one to come back.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;       // Queue gained an item or the pool a chunk
+    TraceChunk *free_list;
+    TraceChunk *head;
+    TraceChunk *tail;
+    int stop;
+    int failed;
+    pthread_t thread;
+    unsigned char *scratch;
+} TraceFlusher;
+
+// A writer owns a chunk only while its program is running
+typedef struct TraceWriter {
+    TraceFlusher *flusher;
+    FILE *file;
+    TraceChunk *chunk;
+    unsigned char *data;        // chunk->data, or NULL between runs
+    size_t used;
+    long steps;
+    unsigned long long bytes;   // Compressed bytes written, updated by the flusher
+} TraceWriter;
+
+// Bound on lz_compress output for n input bytes
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+
+unsigned int lz_read32(const unsigned char *p) {
+    unsigned int v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+unsigned char *lz_put_length(unsigned char *op, size_t length) {
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (unsigned char)length;
+    return op;
+}
+
+unsigned char *lz_put_sequence(unsigned char *op, const unsigned char *literals,
+                               size_t literal_count, size_t offset, size_t match) {
+    unsigned char *token = op++;
+    size_t match_code = match ? match - LZ_MIN_MATCH : 0;
+    
+    *token = (literal_count < 15 ? literal_count : 15) << 4 | (match_code < 15 ? match_code : 15);
+    if (literal_count >= 15) {
+        op = lz_put_length(op, literal_count - 15);
+    }
+    memcpy(op, literals, literal_count);
+    op += literal_count;
+    if (match) {
+        *op++ = offset & 0xFF;
+        *op++ = offset >> 8;
+        if (match_code >= 15) {
+            op = lz_put_length(op, match_code - 15);
+        }
+    }
+    return op;
+}
+
+// Greedy LZ77 in the LZ4 sequence layout: token (literal count, match
+// length), literals, 16-bit offset. Step records repeat with every loop
+// iteration, which this catches cheaply. Returns the compressed size.
+size_t lz_compress(const unsigned char *in, size_t n, unsigned char *out) {
+    int table[1 << LZ_HASH_BITS];
+    size_t ip = 0;
+    size_t anchor = 0;
+    unsigned char *op = out;
+    
+    memset(table, -1, sizeof(table));
+    while (ip + LZ_MIN_MATCH <= n) {
+        unsigned int word = lz_read32(in + ip);
+        unsigned int h = (word * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int ref = table[h];
+        table[h] = (int)ip;
+        if (ref < 0 || ip - ref > 0xFFFF || lz_read32(in + ref) != word) {
+            ip++;
+            continue;
         }
         
-        running = execute_instruction(vm);
-        steps++;
+        size_t match = LZ_MIN_MATCH;
+        while (ip + match + 8 <= n) {
+            unsigned long long a, b;
+            memcpy(&a, in + ref + match, 8);
+            memcpy(&b, in + ip + match, 8);
+            if (a != b) {
+                match += __builtin_ctzll(a ^ b) / 8;
+                goto matched;
+            }
+            match += 8;
+        }
+        while (ip + match < n && in[ref + match] == in[ip + match]) {
+            match++;
+        }
+    matched:
+        op = lz_put_sequence(op, in + anchor, ip - anchor, ip - ref, match);
+        ip += match;
+        anchor = ip;
+    }
+    if (anchor < n || op == out) {
+        op = lz_put_sequence(op, in + anchor, n - anchor, 0, 0);
+    }
+    return op - out;
+}
+
+int lz_get_length(const unsigned char **ip, const unsigned char *end, size_t *length) {
+    unsigned char b;
+    do {
+        if (*ip >= end) {
+            return -1;
+        }
+        b = *(*ip)++;
+        *length += b;
+    } while (b == 255);
+    return 0;
+}
+
+// Returns the decompressed size, or -1 if the data is corrupt
+long lz_decompress(const unsigned char *in, size_t n, unsigned char *out, size_t capacity) {
+    const unsigned char *ip = in;
+    const unsigned char *end = in + n;
+    size_t pos = 0;
+    
+    while (ip < end) {
+        unsigned char token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15 && lz_get_length(&ip, end, &literals) < 0) {
+            return -1;
+        }
+        if (literals > (size_t)(end - ip) || literals > capacity - pos) {
+            return -1;
+        }
+        memcpy(out + pos, ip, literals);
+        ip += literals;
+        pos += literals;
+        if (ip >= end) {
+            break;
+        }
         
-        if (verbose) {
-            printf("\n");
+        if (end - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        size_t match = (token & 0x0F);
+        if (match == 15 && lz_get_length(&ip, end, &match) < 0) {
+            return -1;
+        }
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > pos || match > capacity - pos) {
+            return -1;
+        }
+        for (size_t i = 0; i < match; i++, pos++) {
+            out[pos] = out[pos - offset];
         }
     }
+    return (long)pos;
+}
+
+void put32(unsigned char *p, unsigned int v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = v >> 24;
+}
+
+unsigned int get32(const unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+void *trace_flush_thread(void *arg) {
+    TraceFlusher *f = arg;
     
-    printf("\nExecution finished after %d steps.\n", steps);
-    print_state(vm);
+    pthread_mutex_lock(&f->lock);
+    for (;;) {
+        while (!f->head && !f->stop) {
+            pthread_cond_wait(&f->ready, &f->lock);
+        }
+        TraceChunk *chunk = f->head;
+        if (!chunk) {
+            break;  // Stopped and drained
+        }
+        f->head = chunk->next;
+        if (!f->head) {
+            f->tail = NULL;
+        }
+        pthread_mutex_unlock(&f->lock);
+        
+        TraceWriter *w = chunk->writer;
+        int failed = 0;
+        if (chunk->used) {
+            size_t size = lz_compress(chunk->data, chunk->used, f->scratch + 8);
+            put32(f->scratch, chunk->used);
+            put32(f->scratch + 4, size);
+            failed = fwrite(f->scratch, 1, size + 8, w->file) != size + 8;
+            w->bytes += size + 8;
+        }
+        if (chunk->close) {
+            failed |= fclose(w->file) != 0;
+        }
+        
+        pthread_mutex_lock(&f->lock);
+        f->failed |= failed;
+        chunk->next = f->free_list;
+        f->free_list = chunk;
+        pthread_cond_broadcast(&f->ready);
+    }
+    pthread_mutex_unlock(&f->lock);
+    return NULL;
+}
+
+TraceFlusher *trace_flusher_create(int chunks) {
+    TraceFlusher *f = calloc(1, sizeof(TraceFlusher));
+    if (!f || !(f->scratch = malloc(LZ_BOUND(TRACE_CHUNK_SIZE) + 8))) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(1);
+    }
+    for (int i = 0; i < chunks; i++) {
+        TraceChunk *chunk = malloc(sizeof(TraceChunk));
+        if (!chunk) {
+            fprintf(stderr, "Error: Out of memory\n");
+            exit(1);
+        }
+        chunk->next = f->free_list;
+        f->free_list = chunk;
+    }
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->ready, NULL);
+    pthread_create(&f->thread, NULL, trace_flush_thread, f);
+    return f;
+}
+
+// Wait for every submitted chunk to be written and free the flusher.
+// Returns -1 if any write failed.
+int trace_flusher_finish(TraceFlusher *f) {
+    pthread_mutex_lock(&f->lock);
+    f->stop = 1;
+    pthread_cond_broadcast(&f->ready);
+    pthread_mutex_unlock(&f->lock);
+    pthread_join(f->thread, NULL);
     
-    // Print data section (addresses 0x80-0x8F by default)
-    printf("\nFinal data values:\n");
-    dump_memory(vm, 0x80, 0x8F);
+    int failed = f->failed;
+    while (f->free_list) {
+        TraceChunk *next = f->free_list->next;
+        free(f->free_list);
+        f->free_list = next;
+    }
+    pthread_mutex_destroy(&f->lock);
+    pthread_cond_destroy(&f->ready);
+    free(f->scratch);
+    free(f);
+    return failed ? -1 : 0;
 }
 
-void print_usage(const char *prog_name) {
-    printf("Usage: %s <program.bin> [options]\n", prog_name);
-    printf("Options:\n");
-    printf("  -s, --steps N     Maximum number of steps to execute (0 for unlimited)\n");
-    printf("  -v, --verbose     Print detailed execution information\n");
-    printf("  -h, --help        Print this help message\n");
+TraceChunk *trace_acquire_chunk(TraceFlusher *f) {
+    pthread_mutex_lock(&f->lock);
+    while (!f->free_list) {
+        pthread_cond_wait(&f->ready, &f->lock);
+    }
+    TraceChunk *chunk = f->free_list;
+    f->free_list = chunk->next;
+    pthread_mutex_unlock(&f->lock);
+    return chunk;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        print_usage(argv[0]);
-        return 1;
+void trace_submit(TraceFlusher *f, TraceChunk *chunk) {
+    chunk->next = NULL;
+    pthread_mutex_lock(&f->lock);
+    if (f->tail) {
+        f->tail->next = chunk;
+    } else {
+        f->head = chunk;
     }
+    f->tail = chunk;
+    pthread_cond_broadcast(&f->ready);
+    pthread_mutex_unlock(&f->lock);
+}
+
+// Open a trace file and write its header from the initial state.
+// Returns NULL if the file cannot be created.
+TraceWriter *trace_open(TraceFlusher *f, const char *path, const NeanderVM *vm) {
+    unsigned char header[TRACE_HEADER_SIZE] = { 0 };
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        return NULL;
+    }
+    TraceWriter *w = calloc(1, sizeof(TraceWriter));
+    if (!w) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(1);
+    }
+    w->flusher = f;
+    w->file = file;
     
-    const char *filename = NULL;
-    int max_steps = 1000;  // Default max steps
-    int verbose = 0;       // Default verbosity
-    
-    // Parse command line arguments
-    for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
-            print_usage(argv[0]);
+    memcpy(header, TRACE_MAGIC, 4);
+    header[4] = TRACE_VERSION;
+    memcpy(header + 8, vm->memory, MEMORY_SIZE);
+    header[8 + MEMORY_SIZE] = vm->accumulator;
+    header[9 + MEMORY_SIZE] = vm->PC;
+    header[10 + MEMORY_SIZE] = vm->N;
+    header[11 + MEMORY_SIZE] = vm->Z;
+    if (fwrite(header, 1, sizeof(header), file) != sizeof(header)) {
+        f->failed = 1;
+    }
+    w->bytes = sizeof(header);
+    return w;
+}
+
+// Hand the current chunk to the flusher and take a fresh one
+void trace_next_chunk(TraceWriter *w) {
+    if (w->chunk) {
+        w->chunk->used = w->used;
+        w->chunk->writer = w;
+        w->chunk->close = 0;
+        trace_submit(w->flusher, w->chunk);
+    }
+    w->chunk = trace_acquire_chunk(w->flusher);
+    w->data = w->chunk->data;
+    w->used = 0;
+}
+
+// Room for one more record at the end of the current chunk
+static inline unsigned char *trace_reserve(TraceWriter *w) {
+    if (!w->data || w->used > TRACE_CHUNK_SIZE - TRACE_MAX_RECORD) {
+        trace_next_chunk(w);
+    }
+    return w->data + w->used;
+}
+
+// Give the writer's chunk back between runs, so idle writers hold none
+void trace_pause(TraceWriter *w) {
+    if (w->chunk) {
+        w->chunk->used = w->used;
+        w->chunk->writer = w;
+        w->chunk->close = 0;
+        trace_submit(w->flusher, w->chunk);
+        w->chunk = NULL;
+        w->data = NULL;
+    }
+}
+
+// Flush what is left and have the flusher close the file. The writer's
+// 'bytes' is final, and the writer can be freed, after trace_flusher_finish.
+void trace_close(TraceWriter *w) {
+    trace_pause(w);
+    TraceChunk *chunk = trace_acquire_chunk(w->flusher);
+    chunk->used = 0;
+    chunk->writer = w;
+    chunk->close = 1;
+    trace_submit(w->flusher, chunk);
+}
+
+// One pre-decoded instruction: the handler to jump to and its operand byte.
+// A fused entry also carries the operands of the instructions it absorbed.
+typedef struct {
+    const void *handler;
+    unsigned char operand;
+    unsigned char operand2;
+    unsigned char operand3;
+} DecodedOp;
+
+int fuse_instructions = 1;      // Cleared by --no-fuse
+
+// Superinstructions for the copy and add sequences main.c emits
+// everywhere: LDA x / STA y and LDA a / ADD b / STA c. Returns the length
+// in bytes of the sequence starting at pc, or 0.
+int fused_length(const unsigned char *mem, unsigned char pc) {
+    if ((mem[pc] & 0xF0) != OP_LDA) {
+        return 0;
+    }
+    unsigned char second = mem[(unsigned char)(pc + 2)] & 0xF0;
+    if (second == OP_STA) {
+        return 4;
+    }
+    if (second == OP_ADD && (mem[(unsigned char)(pc + 4)] & 0xF0) == OP_STA) {
+        return 6;
+    }
+    return 0;
+}
+
+// Decoded view of all 256 addresses used by the threaded engine. Entries
+// start out pointing at a decode stub and are filled in on first execution;
+// a store invalidates only the two entries whose bytes it overwrote.
+// Clear 'ready' whenever memory is changed behind the engine's back.
+// 'code_written' is set once an invalidated entry is decoded again, i.e.
+// the program executed bytes it had modified itself.
+// 'iterations_skipped' counts loop iterations replaced by run_idiom.
+// With 'profile' or 'trace' set, entries decode to counting or recording
+// handlers instead, so a run without them pays nothing for the features.
+// Breakpoints and watchpoints work the same way: an address in the
+// 'breakpoints' bitmap decodes to a stopping handler, and an STA whose
+// operand is in 'watchpoints' decodes to a reporting store, so nothing is
+// checked per step. Change any of these only together with clearing
+// 'ready'.
+typedef enum {
+    STOP_NONE,
+    STOP_BREAK,     // Before the instruction at a breakpoint; not a step
+    STOP_WATCH      // After a store to a watched address
+} StopReason;
+
+typedef struct {
+    DecodedOp ops[MEMORY_SIZE];
+    int ready;
+    int code_written;
+    long iterations_skipped;
+    Profile *profile;
+    TraceWriter *trace;
+    const unsigned char *breakpoints;
+    const unsigned char *watchpoints;
+    StopReason stop;            // Why the last run stopped early
+    int skip_break;             // Resume past the breakpoint at PC
+    unsigned char watch_pc, watch_addr, watch_old, watch_new;
+    long fused_steps;           // Steps run inside fused entries beyond the first
+    // For each byte inside a fused sequence, its distance from the
+    // sequence's entry (0 if none), so a store there can invalidate it
+    unsigned char fused_head[MEMORY_SIZE];
+} DecodeCache;
+
+void init_cache(DecodeCache *cache) {
+    cache->ready = 0;
+    cache->iterations_skipped = 0;
+    cache->profile = NULL;
+    cache->trace = NULL;
+    cache->breakpoints = NULL;
+    cache->watchpoints = NULL;
+    cache->stop = STOP_NONE;
+    cache->skip_break = 0;
+    cache->fused_steps = 0;
+}
+
+// Can the sequence at pc be fused? Not if any of its bytes already belongs
+// to another fused entry, or if a breakpoint or watchpoint inside it would
+// be skipped.
+int fusion_allowed(const DecodeCache *cache, const unsigned char *mem, unsigned char pc, int length) {
+    for (int i = 1; i < length; i++) {
+        unsigned char b = pc + i;
+        if (cache->fused_head[b] && (unsigned char)(b - cache->fused_head[b]) != pc) {
+            return 0;
+        }
+        if (cache->breakpoints && i % 2 == 0 && cache->breakpoints[b]) {
             return 0;
-        } else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--steps") == 0) {
-            if (i + 1 < argc) {
-                max_steps = atoi(argv[i + 1]);
-                i++;
-            }
-        } else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
-            verbose = 1;
-        } else if (filename == NULL) {
-            filename = argv[i];
         }
     }
+    unsigned char target = mem[(unsigned char)(pc + length - 1)];
+    return !cache->watchpoints || !cache->watchpoints[target];
+}
+
+// Would a breakpoint or watchpoint fire inside this idiom's loop?
+int idiom_armed(const DecodeCache *cache, unsigned char pc, const LoopIdiom *idiom) {
+    int size = idiom->kind == IDIOM_MUL ? MUL_IDIOM_SIZE : DIV_IDIOM_SIZE;
     
-    if (filename == NULL) {
-        fprintf(stderr, "Error: No input file specified\n");
-        print_usage(argv[0]);
+    if (cache->watchpoints &&
+        (cache->watchpoints[idiom->counter] || cache->watchpoints[idiom->result])) {
         return 1;
     }
+    for (int i = 0; cache->breakpoints && i < size; i++) {
+        if (cache->breakpoints[(unsigned char)(pc + i)]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The threaded engine evaluates flags lazily: instead of N and Z it keeps
+// the last value that set them, and derives N and Z only at JN/JZ and on
+// exit. Bit 8 of the source stands for N when N and Z are both set, a
+// combination no byte produces. Build with -DNEANDER_EAGER_FLAGS to
+// compute them after every instruction instead, for comparison.
+unsigned int flag_source(unsigned char n, unsigned char z) {
+    return z ? (n ? 0x100 : 0) : (n ? 0x80 : 1);
+}
+
+// Direct-threaded engine: every handler jumps straight to the next one
+// through a computed goto, with the machine state kept in locals.
+// No I/O is done per step. Returns the number of steps executed (HLT
+// counts as a step, as in run()) and sets *halted when HLT was reached.
+long run_threaded(NeanderVM *vm, DecodeCache *cache, long max_steps, int *halted) {
+    static const void *dispatch[16] = {
+        &&op_nop, &&op_sta, &&op_lda, &&op_add,
+        &&op_or,  &&op_and, &&op_not, &&op_unknown,
+        &&op_jmp, &&op_jn,  &&op_jz,  &&op_unknown,
+        &&op_unknown, &&op_unknown, &&op_unknown, &&op_hlt
+    };
+    static const void *profiled[16] = {
+        &&prof_nop, &&prof_sta, &&prof_lda, &&prof_add,
+        &&prof_or,  &&prof_and, &&prof_not, &&prof_unknown,
+        &&prof_jmp, &&prof_jn,  &&prof_jz,  &&prof_unknown,
+        &&prof_unknown, &&prof_unknown, &&prof_unknown, &&prof_hlt
+    };
+    static const void *traced[16] = {
+        &&trace_nop, &&trace_sta, &&trace_lda, &&trace_add,
+        &&trace_or,  &&trace_and, &&trace_not, &&trace_nop,
+        &&trace_jmp, &&trace_jn,  &&trace_jz,  &&trace_nop,
+        &&trace_nop, &&trace_nop, &&trace_nop, &&trace_hlt
+    };
+    DecodedOp *ops = cache->ops;
+    Profile *profile = cache->profile;
+    TraceWriter *trace = cache->trace;
+    const unsigned char *breakpoints = cache->breakpoints;
+    const unsigned char *watchpoints = cache->watchpoints;
+    int skip_break = cache->skip_break;
+    unsigned char *record;
+    unsigned char *mem = vm->memory;
+    unsigned char ac = vm->accumulator;
+    unsigned char pc = vm->PC;
+#ifdef NEANDER_EAGER_FLAGS
+    unsigned char n = vm->N;
+    unsigned char z = vm->Z;
+#define SET_FLAGS() do { n = ac >> 7; z = (ac == 0); } while (0)
+#define FLAG_N n
+#define FLAG_Z z
+#else
+    unsigned int flags = flag_source(vm->N, vm->Z);
+#define SET_FLAGS() (flags = ac)
+#define FLAG_N ((flags >> 7 | flags >> 8) & 1)
+#define FLAG_Z ((flags & 0xFF) == 0)
+#endif
+    unsigned char addr;
+    unsigned char *fused_head = cache->fused_head;
+    int length;
+    LoopIdiom idiom;
+    long budget = max_steps > 0 ? max_steps : LONG_MAX;
+    long left = budget;
     
-    NeanderVM vm;
-    init_vm(&vm);
-    load_program(&vm, filename);
+    *halted = 0;
+    cache->stop = STOP_NONE;
+    cache->skip_break = 0;
+    
+    if (!cache->ready) {
+        for (int i = 0; i < MEMORY_SIZE; i++) {
+            ops[i].handler = &&decode;
+        }
+        memset(fused_head, 0, MEMORY_SIZE);
+        cache->ready = 1;
+        cache->code_written = 0;
+    }
+    
+#define OPERAND ops[pc].operand
+// The stored byte is the opcode of one entry, the operand of another and
+// possibly part of a fused entry
+#define INVALIDATE(a) do { \
+        ops[a].handler = &&redecode; \
+        ops[(unsigned char)((a) - 1)].handler = &&redecode; \
+        if (fused_head[a]) { \
+            ops[(unsigned char)((a) - fused_head[a])].handler = &&redecode; \
+        } \
+    } while (0)
+#define DISPATCH() do { \
+        if (left == 0) goto out; \
+        left--; \
+        goto *ops[pc].handler; \
+    } while (0)
+    
+    DISPATCH();
+    
+redecode:
+    cache->code_written = 1;
+decode:
+    ops[pc].handler = (trace ? traced : profile ? profiled : dispatch)[mem[pc] >> 4];
+    ops[pc].operand = mem[(unsigned char)(pc + 1)];
+    if (accelerate_idioms && !profile && !trace && match_idiom(mem, pc, &idiom)) {
+        ops[pc].handler = &&op_idiom;
+    }
+    if (fuse_instructions && !profile && !trace && (length = fused_length(mem, pc)) &&
+        fusion_allowed(cache, mem, pc, length)) {
+        for (int i = 1; i < length; i++) {
+            fused_head[(unsigned char)(pc + i)] = i;
+        }
+        ops[pc].operand2 = mem[(unsigned char)(pc + 3)];
+        ops[pc].operand3 = mem[(unsigned char)(pc + 5)];
+        ops[pc].handler = length == 4 ? &&op_lda_sta : &&op_lda_add_sta;
+    }
+    if (watchpoints && (mem[pc] & 0xF0) == OP_STA && watchpoints[OPERAND]) {
+        ops[pc].handler = &&op_sta_watch;
+    }
+    if (breakpoints && breakpoints[pc]) {
+        ops[pc].handler = &&op_break;
+    }
+    goto *ops[pc].handler;
+    
+op_break:
+    if (skip_break) {
+        skip_break = 0;
+        if (watchpoints && (mem[pc] & 0xF0) == OP_STA && watchpoints[OPERAND]) {
+            goto op_sta_watch;
+        }
+        goto *dispatch[mem[pc] >> 4];
+    }
+    left++;     // Stopped before the instruction ran
+    cache->stop = STOP_BREAK;
+    goto out;
+op_sta_watch:
+    addr = OPERAND;
+    cache->watch_pc = pc;
+    cache->watch_addr = addr;
+    cache->watch_old = mem[addr];
+    cache->watch_new = ac;
+    cache->stop = STOP_WATCH;
+    mem[addr] = ac;
+    INVALIDATE(addr);
+    pc += 2;
+    goto out;
+    
+    // Counting front ends of the handlers below
+#define PROFILE(op) do { profile->exec[pc]++; profile->opcodes[(op) >> 4]++; } while (0)
+prof_nop:
+    PROFILE(OP_NOP);
+    goto op_nop;
+prof_unknown:
+    PROFILE(mem[pc]);
+    goto op_unknown;
+prof_sta:
+    PROFILE(OP_STA);
+    profile->writes[OPERAND]++;
+    goto op_sta;
+prof_lda:
+    PROFILE(OP_LDA);
+    profile->reads[OPERAND]++;
+    goto op_lda;
+prof_add:
+    PROFILE(OP_ADD);
+    profile->reads[OPERAND]++;
+    goto op_add;
+prof_or:
+    PROFILE(OP_OR);
+    profile->reads[OPERAND]++;
+    goto op_or;
+prof_and:
+    PROFILE(OP_AND);
+    profile->reads[OPERAND]++;
+    goto op_and;
+prof_not:
+    PROFILE(OP_NOT);
+    goto op_not;
+prof_jmp:
+    PROFILE(OP_JMP);
+    goto op_jmp;
+prof_jn:
+    PROFILE(OP_JN);
+    profile->taken[pc] += FLAG_N;
+    profile->not_taken[pc] += !FLAG_N;
+    goto op_jn;
+prof_jz:
+    PROFILE(OP_JZ);
+    profile->taken[pc] += FLAG_Z;
+    profile->not_taken[pc] += !FLAG_Z;
+    goto op_jz;
+prof_hlt:
+    PROFILE(OP_HLT);
+    goto op_hlt;
+#undef PROFILE
+    
+    // Recording front ends: write the step's record, then run the handler
+#define TRACE_LOAD(value) do { \
+        unsigned char v = (value); \
+        record = trace_reserve(trace); \
+        if (v != ac) { \
+            record[0] = TRACE_PC_NEXT2 | TRACE_AC; \
+            record[1] = v - ac; \
+            trace->used += 2; \
+        } else { \
+            record[0] = (FLAG_N != ac >> 7 || FLAG_Z != (ac == 0)) ? TRACE_PC_NEXT2 | TRACE_FLAGS : TRACE_PC_NEXT2; \
+            trace->used += 1; \
+        } \
+    } while (0)
+#define TRACE_BRANCH(cond) do { \
+        record = trace_reserve(trace); \
+        if (cond) { \
+            record[0] = TRACE_PC_JUMP; \
+            record[1] = OPERAND; \
+            trace->used += 2; \
+        } else { \
+            record[0] = TRACE_PC_NEXT2; \
+            trace->used += 1; \
+        } \
+    } while (0)
+trace_nop:
+    record = trace_reserve(trace);
+    record[0] = TRACE_PC_NEXT1;
+    trace->used += 1;
+    goto *dispatch[mem[pc] >> 4];
+trace_sta:
+    record = trace_reserve(trace);
+    record[0] = TRACE_PC_NEXT2 | TRACE_WRITE;
+    record[1] = OPERAND;
+    record[2] = ac;
+    trace->used += 3;
+    goto op_sta;
+trace_lda:
+    TRACE_LOAD(mem[OPERAND]);
+    goto op_lda;
+trace_add:
+    TRACE_LOAD(ac + mem[OPERAND]);
+    goto op_add;
+trace_or:
+    TRACE_LOAD(ac | mem[OPERAND]);
+    goto op_or;
+trace_and:
+    TRACE_LOAD(ac & mem[OPERAND]);
+    goto op_and;
+trace_not:
+    record = trace_reserve(trace);
+    record[0] = TRACE_PC_NEXT1 | TRACE_AC;
+    record[1] = (unsigned char)~ac - ac;
+    trace->used += 2;
+    goto op_not;
+trace_jmp:
+    TRACE_BRANCH(1);
+    goto op_jmp;
+trace_jn:
+    TRACE_BRANCH(FLAG_N);
+    goto op_jn;
+trace_jz:
+    TRACE_BRANCH(FLAG_Z);
+    goto op_jz;
+trace_hlt:
+    record = trace_reserve(trace);
+    record[0] = TRACE_PC_STAY;
+    trace->used += 1;
+    goto op_hlt;
+#undef TRACE_LOAD
+#undef TRACE_BRANCH
+    
+op_idiom:
+    // The loop body may have been patched since the entry was decoded, so
+    // match again; fall back to the plain LDA when it no longer applies
+    if (match_idiom(mem, pc, &idiom) && !idiom_armed(cache, pc, &idiom)) {
+        long iterations;
+        vm->accumulator = ac;
+        vm->PC = pc;
+        long steps = run_idiom(vm, &idiom, left + 1, &iterations);
+        if (steps) {
+            left -= steps - 1;
+            cache->iterations_skipped += iterations;
+            ac = vm->accumulator;
+            pc = vm->PC;
+            SET_FLAGS();
+            INVALIDATE(idiom.counter);
+            INVALIDATE(idiom.result);
+            DISPATCH();
+        }
+    }
+    goto op_lda;
     
-    run(&vm, max_steps, verbose);
+op_nop:
+op_unknown:
+    pc++;
+    DISPATCH();
+op_sta:
+    addr = OPERAND;
+    mem[addr] = ac;
+    INVALIDATE(addr);
+    pc += 2;
+    DISPATCH();
+op_lda_sta:
+    // Fused entries count every instruction they run; without budget for
+    // all of them, run the LDA alone
+    if (left < 1) {
+        goto op_lda;
+    }
+    left--;
+    cache->fused_steps++;
+    ac = mem[OPERAND];
+    SET_FLAGS();
+    addr = ops[pc].operand2;
+    mem[addr] = ac;
+    INVALIDATE(addr);
+    pc += 4;
+    DISPATCH();
+op_lda_add_sta:
+    if (left < 2) {
+        goto op_lda;
+    }
+    left -= 2;
+    cache->fused_steps += 2;
+    ac = mem[OPERAND] + mem[ops[pc].operand2];
+    SET_FLAGS();
+    addr = ops[pc].operand3;
+    mem[addr] = ac;
+    INVALIDATE(addr);
+    pc += 6;
+    DISPATCH();
+op_lda:
+    ac = mem[OPERAND];
+    SET_FLAGS();
+    pc += 2;
+    DISPATCH();
+op_add:
+    ac += mem[OPERAND];
+    SET_FLAGS();
+    pc += 2;
+    DISPATCH();
+op_or:
+    ac |= mem[OPERAND];
+    SET_FLAGS();
+    pc += 2;
+    DISPATCH();
+op_and:
+    ac &= mem[OPERAND];
+    SET_FLAGS();
+    pc += 2;
+    DISPATCH();
+op_not:
+    ac = ~ac;
+    SET_FLAGS();
+    pc++;
+    DISPATCH();
+op_jmp:
+    pc = OPERAND;
+    DISPATCH();
+op_jn:
+    pc = FLAG_N ? OPERAND : (unsigned char)(pc + 2);
+    DISPATCH();
+op_jz:
+    pc = FLAG_Z ? OPERAND : (unsigned char)(pc + 2);
+    DISPATCH();
+op_hlt:
+    *halted = 1;
+    
+out:
+#undef OPERAND
+#undef SET_FLAGS
+#undef DISPATCH
+    vm->accumulator = ac;
+    vm->PC = pc;
+    vm->N = FLAG_N;
+    vm->Z = FLAG_Z;
+#undef FLAG_N
+#undef FLAG_Z
+    return budget - left;
+}
+
+// Prepare a cache for another run starting from the image it was built
+// from. Entries decoded from untouched bytes stay valid; only a program
+// that executed its own stores forces a full rebuild.
+void rewind_cache(DecodeCache *cache) {
+    if (cache->code_written) {
+        cache->ready = 0;
+    }
+}
+
+#ifdef HAVE_JIT
+#define JIT_BUFFER_SIZE (1 << 20)
+#define JIT_MAX_BLOCK 64          // Instructions per translated block
+
+// Worst-case host bytes, counted from the emitters in jit_translate: the
+// entry load, an STA whose SMC exit writes back AC, N and Z (mov, cmp, je
+// and a 28-byte exit), and a looping JMP, the longest way to end a block
+#define JIT_ENTRY_CODE 7
+#define JIT_MAX_INSTRUCTION_CODE 43
+#define JIT_MAX_END_CODE 49
+#define JIT_MAX_BLOCK_CODE (JIT_ENTRY_CODE + JIT_MAX_BLOCK * JIT_MAX_INSTRUCTION_CODE + \
+                            JIT_MAX_END_CODE + 16)
+
+// Translated blocks return a packed word describing how they exited
+#define JIT_EXIT_PC(r)      ((unsigned char)((r) & 0xFF))
+#define JIT_EXIT_ADDR(r)    ((unsigned char)(((r) >> 8) & 0xFF))
+#define JIT_EXIT_HALT       (1u << 16)
+#define JIT_EXIT_SMC        (1u << 17)   // STA hit translated code
+#define JIT_EXIT_COUNT(r)   ((r) >> 20)
+
+// Steps charged by looping blocks at each back-edge, and the count after
+// which they must return to the dispatcher instead of looping again
+typedef struct {
+    long steps;
+    long limit;
+} JitBudget;
+
+typedef unsigned int (*JitBlockFn)(NeanderVM *vm, const unsigned char *code_map,
+                                   JitBudget *budget);
+
+typedef struct {
+    JitBlockFn fn;      // NULL when the block is not translated
+    int length;         // Bytes of Neander code covered from the entry PC
+    int count;          // Instructions in the block
+} JitBlock;
+
+// Translation state: the executable buffer, one block per entry PC, and a
+// per-byte count of the blocks covering it that STA checks against
+typedef struct {
+    unsigned char *buffer;
+    size_t used;
+    JitBlock blocks[MEMORY_SIZE];
+    unsigned char code_map[MEMORY_SIZE];
+    unsigned char source[MEMORY_SIZE];  // Bytes the live blocks were translated from
+    long translated;
+    long invalidated;
+} JitState;
+
+JitState *jit_create(void) {
+    JitState *jit = calloc(1, sizeof(JitState));
+    if (!jit) {
+        return NULL;
+    }
+    jit->buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->buffer == MAP_FAILED) {
+        free(jit);
+        return NULL;
+    }
+    return jit;
+}
+
+void jit_destroy(JitState *jit) {
+    munmap(jit->buffer, JIT_BUFFER_SIZE);
+    free(jit);
+}
+
+// Drop every translation, e.g. when the buffer is full or memory was reloaded
+void jit_flush(JitState *jit) {
+    jit->used = 0;
+    memset(jit->blocks, 0, sizeof(jit->blocks));
+    memset(jit->code_map, 0, sizeof(jit->code_map));
+}
+
+// Drop the blocks covering a byte that was just written
+void jit_invalidate(JitState *jit, unsigned char addr) {
+    for (int start = 0; start <= addr; start++) {
+        JitBlock *block = &jit->blocks[start];
+        if (block->fn && start + block->length > addr) {
+            for (int i = start; i < start + block->length; i++) {
+                jit->code_map[i]--;
+            }
+            block->fn = NULL;
+            jit->invalidated++;
+        }
+    }
+}
+
+// Drop the blocks whose source bytes no longer match memory, so translations
+// can be kept when the same image is loaded again
+void jit_revalidate(JitState *jit, const NeanderVM *vm) {
+    for (int i = 0; i < MEMORY_SIZE; i++) {
+        if (jit->code_map[i] && jit->source[i] != vm->memory[i]) {
+            jit_invalidate(jit, i);
+        }
+    }
+}
+
+typedef struct {
+    unsigned char *p;
+} Emitter;
+
+void emit8(Emitter *e, unsigned int b) {
+    *e->p++ = (unsigned char)b;
+}
+
+void emit32(Emitter *e, unsigned int v) {
+    memcpy(e->p, &v, 4);
+    e->p += 4;
+}
+
+// <op> with a [rdi + disp32] memory operand and AL as the register operand
+void emit_mem_op(Emitter *e, unsigned int opcode, unsigned int disp) {
+    emit8(e, opcode);
+    emit8(e, 0x87);
+    emit32(e, disp);
+}
+
+// Write AC back, and N/Z if the block executed a flag-setting instruction
+void emit_writeback(Emitter *e, int flags_set) {
+    emit_mem_op(e, 0x88, offsetof(NeanderVM, accumulator));   // mov [ac], al
+    if (flags_set) {
+        emit8(e, 0x84); emit8(e, 0xC0);                       // test al, al
+        emit8(e, 0x0F);
+        emit_mem_op(e, 0x98, offsetof(NeanderVM, N));         // sets [N]
+        emit8(e, 0x0F);
+        emit_mem_op(e, 0x94, offsetof(NeanderVM, Z));         // sete [Z]
+    }
+}
+
+// Leave the block with the machine state written back and 'result' in EAX.
+// Returns the number of bytes emitted.
+int emit_exit(Emitter *e, int flags_set, unsigned int result) {
+    unsigned char *start = e->p;
+    
+    emit_writeback(e, flags_set);
+    emit8(e, 0xB8); emit32(e, result);                        // mov eax, result
+    emit8(e, 0xC3);                                           // ret
+    return e->p - start;
+}
+
+unsigned int jit_result(unsigned char pc, int count) {
+    return pc | ((unsigned int)count << 20);
+}
+
+// Translate the code starting at 'entry' into one superblock: straight-line
+// code where JN/JZ leave the block when taken and fall through otherwise,
+// ending at JMP, HLT or the size limit. A JMP back to the entry becomes a
+// native loop that charges each pass to the budget before going round again.
+// AC lives in AL, the VM in RDI, the code map in RSI and the JitBudget in
+// RDX; N and Z are only written back when the block is left or loops.
+// Returns 0 if nothing could be translated (an instruction straddling 0xFF).
+int jit_translate(JitState *jit, NeanderVM *vm, unsigned char entry) {
+    if (jit->used + JIT_MAX_BLOCK_CODE > JIT_BUFFER_SIZE) {
+        jit_flush(jit);
+    }
+    
+    unsigned char *code = jit->buffer + jit->used;
+    Emitter e = { code };
+    int pc = entry;
+    int count = 0;
+    int flags_set = 0;
+    int done = 0;
+    
+    if (mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE) != 0) {
+        return 0;
+    }
+    
+    emit8(&e, 0x0F); emit_mem_op(&e, 0xB6, offsetof(NeanderVM, accumulator));  // movzx eax, [ac]
+    unsigned char *head = e.p;
+    
+    while (!done) {
+        unsigned char opcode = vm->memory[pc] & 0xF0;
+        int length = (opcode == OP_STA || opcode == OP_LDA || opcode == OP_ADD ||
+                      opcode == OP_OR || opcode == OP_AND || opcode == OP_JMP ||
+                      opcode == OP_JN || opcode == OP_JZ) ? 2 : 1;
+        
+        if (count == JIT_MAX_BLOCK || pc + length > MEMORY_SIZE) {
+            if (count == 0) {
+                mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC);
+                return 0;
+            }
+            emit_exit(&e, flags_set, jit_result(pc, count));
+            break;
+        }
+        
+        unsigned char operand = length == 2 ? vm->memory[pc + 1] : 0;
+        unsigned char *skip;
+        count++;
+        
+        switch (opcode) {
+            case OP_LDA: emit_mem_op(&e, 0x8A, operand); flags_set = 1; break;
+            case OP_ADD: emit_mem_op(&e, 0x02, operand); flags_set = 1; break;
+            case OP_OR:  emit_mem_op(&e, 0x0A, operand); flags_set = 1; break;
+            case OP_AND: emit_mem_op(&e, 0x22, operand); flags_set = 1; break;
+            case OP_NOT:
+                emit8(&e, 0xF6); emit8(&e, 0xD0);                 // not al
+                flags_set = 1;
+                break;
+            case OP_STA:
+                emit_mem_op(&e, 0x88, operand);                   // mov [rdi+a], al
+                emit8(&e, 0x80); emit8(&e, 0xBE);                 // cmp byte [rsi+a], 0
+                emit32(&e, operand); emit8(&e, 0x00);
+                emit8(&e, 0x74);                                  // je over the exit
+                skip = e.p;
+                emit8(&e, 0);
+                *skip = emit_exit(&e, flags_set, jit_result(pc + 2, count) |
+                                  JIT_EXIT_SMC | ((unsigned int)operand << 8));
+                break;
+            case OP_JN:
+            case OP_JZ:
+                emit_writeback(&e, flags_set);
+                emit8(&e, 0x80); emit8(&e, 0xBF);                 // cmp byte [flag], 0
+                emit32(&e, opcode == OP_JN ? offsetof(NeanderVM, N) : offsetof(NeanderVM, Z));
+                emit8(&e, 0x00);
+                emit8(&e, 0x74); emit8(&e, 0x06);                 // je: not taken
+                emit8(&e, 0xB8); emit32(&e, jit_result(operand, count));
+                emit8(&e, 0xC3);
+                break;
+            case OP_JMP:
+                if (operand == entry) {
+                    emit_writeback(&e, flags_set);
+                    emit8(&e, 0x48); emit8(&e, 0x81); emit8(&e, 0x02);  // add [rdx], count
+                    emit32(&e, count);
+                    emit8(&e, 0x48); emit8(&e, 0x8B); emit8(&e, 0x4A);  // mov rcx, [rdx+8]
+                    emit8(&e, offsetof(JitBudget, limit));
+                    emit8(&e, 0x48); emit8(&e, 0x39); emit8(&e, 0x0A);  // cmp [rdx], rcx
+                    emit8(&e, 0x7F); emit8(&e, 0x05);                   // jg: out of budget
+                    emit8(&e, 0xE9);                                    // jmp head
+                    emit32(&e, (unsigned int)(head - (e.p + 4)));
+                    emit8(&e, 0xB8); emit32(&e, jit_result(entry, 0));
+                    emit8(&e, 0xC3);
+                } else {
+                    emit_exit(&e, flags_set, jit_result(operand, count));
+                }
+                done = 1;
+                break;
+            case OP_HLT:
+                emit_exit(&e, flags_set, jit_result(pc, count) | JIT_EXIT_HALT);
+                done = 1;
+                break;
+            default:
+                break;  // NOP and unknown opcodes only advance PC
+        }
+        pc += length;
+    }
+    
+    mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC);
+    
+    JitBlock *block = &jit->blocks[entry];
+    block->fn = (JitBlockFn)(void *)code;
+    block->length = pc - entry;
+    block->count = count;
+    for (int i = entry; i < pc; i++) {
+        jit->code_map[i]++;
+        jit->source[i] = vm->memory[i];
+    }
+    jit->used += e.p - code;
+    jit->translated++;
+    return 1;
+}
+
+// Run translated blocks, falling back to step_vm where a block cannot be
+// translated or would overrun the step budget
+long run_jit(NeanderVM *vm, JitState *jit, long max_steps, int *halted) {
+    JitBudget budget;
+    
+    budget.steps = 0;
+    *halted = 0;
+    while (max_steps == 0 || budget.steps < max_steps) {
+        JitBlock *block = &jit->blocks[vm->PC];
+        if (!block->fn) {
+            jit_translate(jit, vm, vm->PC);
+        }
+        
+        if (!block->fn || (max_steps != 0 && budget.steps + block->count > max_steps)) {
+            unsigned char opcode = vm->memory[vm->PC] & 0xF0;
+            unsigned char operand = vm->memory[(unsigned char)(vm->PC + 1)];
+            int running = step_vm(vm);
+            budget.steps++;
+            if (opcode == OP_STA && jit->code_map[operand]) {
+                jit_invalidate(jit, operand);
+            }
+            if (!running) {
+                *halted = 1;
+                break;
+            }
+            continue;
+        }
+        
+        // A looping block may only start another pass while a full pass fits
+        budget.limit = max_steps != 0 ? max_steps - block->count : LONG_MAX;
+        unsigned int result = block->fn(vm, jit->code_map, &budget);
+        vm->PC = JIT_EXIT_PC(result);
+        budget.steps += JIT_EXIT_COUNT(result);
+        if (result & JIT_EXIT_SMC) {
+            jit_invalidate(jit, JIT_EXIT_ADDR(result));
+        }
+        if (result & JIT_EXIT_HALT) {
+            *halted = 1;
+            break;
+        }
+    }
+    return budget.steps;
+}
+
+// Engine entry point for the benchmark: translations persist across runs
+// as long as the bytes they were made from are unchanged
+long run_jit_engine(NeanderVM *vm, DecodeCache *cache, long max_steps, int *halted) {
+    static JitState *jit = NULL;
+    
+    (void)cache;
+    if (!jit) {
+        jit = jit_create();
+        if (!jit) {
+            fprintf(stderr, "Error: Cannot allocate JIT buffer\n");
+            exit(1);
+        }
+    }
+    jit_revalidate(jit, vm);
+    return run_jit(vm, jit, max_steps, halted);
+}
+#endif
+
+// Print the end-of-run report shared by all engines
+void print_summary(NeanderVM *vm, long steps) {
+    printf("\nExecution finished after %ld steps.\n", steps);
+    print_state(vm);
+    
+    // Print data section (addresses 0x80-0x8F by default)
+    printf("\nFinal data values:\n");
+    dump_memory(vm, 0x80, 0x8F);
+}
+
+void run(NeanderVM *vm, int max_steps, int verbose) {
+    int steps = 0;
+    int running = 1;
+    
+    printf("Starting execution...\n");
+    
+    while (running && (max_steps == 0 || steps < max_steps)) {
+        if (verbose) {
+            print_state(vm);
+        }
+        
+        running = execute_instruction(vm);
+        steps++;
+        
+        if (verbose) {
+            printf("\n");
+        }
+    }
+    
+    print_summary(vm, steps);
+}
+
+// Switch loop used by the benchmark: the same dispatch as run(), minus the I/O
+long run_switch(NeanderVM *vm, DecodeCache *cache, long max_steps, int *halted) {
+    long steps = 0;
+    int running = 1;
+    
+    (void)cache;
+    while (running && (max_steps == 0 || steps < max_steps)) {
+        running = step_vm(vm);
+        steps++;
+    }
+    *halted = !running;
+    return steps;
+}
+
+typedef long (*EngineFn)(NeanderVM *vm, DecodeCache *cache, long max_steps, int *halted);
+
+// Run under one of the I/O-free engines and print the usual report
+void run_fast(NeanderVM *vm, EngineFn engine, int max_steps) {
+    int halted;
+    DecodeCache cache;
+    
+    init_cache(&cache);
+    printf("Starting execution...\n");
+    long steps = engine(vm, &cache, max_steps, &halted);
+    print_summary(vm, steps);
+    if (cache.iterations_skipped) {
+        printf("\nLoop idioms: %ld iterations skipped\n", cache.iterations_skipped);
+    }
+    if (cache.fused_steps) {
+        printf("\nFused instructions: %ld dispatches for %ld steps\n",
+               steps - cache.fused_steps, steps);
+    }
+}
+
+// Run under the threaded engine, reporting every breakpoint and watchpoint
+// hit and carrying on until HLT or the step limit
+void run_watched(NeanderVM *vm, int max_steps, const unsigned char *breakpoints,
+                 const unsigned char *watchpoints) {
+    DecodeCache cache;
+    long steps = 0;
+    long hits = 0;
+    int halted = 0;
+    
+    init_cache(&cache);
+    cache.breakpoints = breakpoints;
+    cache.watchpoints = watchpoints;
+    printf("Starting execution...\n");
+    while (!halted && (max_steps == 0 || steps < max_steps)) {
+        steps += run_threaded(vm, &cache, max_steps ? max_steps - steps : 0, &halted);
+        if (cache.stop == STOP_BREAK) {
+            printf("Breakpoint at PC=%02X after %ld steps: AC: %02X  N: %d  Z: %d\n",
+                   vm->PC, steps, vm->accumulator, vm->N, vm->Z);
+            cache.skip_break = 1;
+        } else if (cache.stop == STOP_WATCH) {
+            printf("Watchpoint %02X: %02X -> %02X by STA at PC=%02X, step %ld\n",
+                   cache.watch_addr, cache.watch_old, cache.watch_new, cache.watch_pc, steps);
+        } else {
+            break;
+        }
+        hits++;
+    }
+    print_summary(vm, steps);
+    printf("\n%ld breakpoint/watchpoint hits\n", hits);
+}
+
+#define PROFILE_HOTTEST 10
+#define PROFILE_LOOPS 5
+
+typedef struct {
+    int pc;
+    unsigned long long count;
+} HotSpot;
+
+int compare_hot_spots(const void *a, const void *b) {
+    const HotSpot *x = a;
+    const HotSpot *y = b;
+    if (x->count != y->count) {
+        return x->count < y->count ? 1 : -1;
+    }
+    return x->pc - y->pc;
+}
+
+void format_instruction(char *buf, size_t size, const unsigned char *mem, unsigned char pc) {
+    unsigned char opcode = mem[pc] >> 4;
+    
+    if (opcode == OP_NOT >> 4 || opcode == OP_HLT >> 4 || opcode == OP_NOP >> 4) {
+        snprintf(buf, size, "%s", opcode_names[opcode]);
+    } else {
+        snprintf(buf, size, "%s %02X", opcode_names[opcode], mem[(unsigned char)(pc + 1)]);
+    }
+}
+
+// Print the hottest instructions, the loops they form and the opcode mix.
+// Instructions are disassembled from the final memory.
+void print_profile_report(const Profile *p, const NeanderVM *vm, long steps) {
+    HotSpot spots[MEMORY_SIZE];
+    HotSpot loops[MEMORY_SIZE];
+    int spot_count = 0;
+    int loop_count = 0;
+    double total = steps > 0 ? steps : 1;
+    char text[16];
+    
+    for (int pc = 0; pc < MEMORY_SIZE; pc++) {
+        if (!p->exec[pc]) {
+            continue;
+        }
+        spots[spot_count].pc = pc;
+        spots[spot_count].count = p->exec[pc];
+        spot_count++;
+        
+        // A backward jump closes a loop over [target, pc]
+        unsigned char opcode = vm->memory[pc] & 0xF0;
+        unsigned char target = vm->memory[(unsigned char)(pc + 1)];
+        if ((opcode == OP_JMP || opcode == OP_JN || opcode == OP_JZ) && target <= pc) {
+            unsigned long long body = 0;
+            for (int a = target; a <= pc; a++) {
+                body += p->exec[a];
+            }
+            loops[loop_count].pc = pc;
+            loops[loop_count].count = body;
+            loop_count++;
+        }
+    }
+    qsort(spots, spot_count, sizeof(HotSpot), compare_hot_spots);
+    qsort(loops, loop_count, sizeof(HotSpot), compare_hot_spots);
+    
+    printf("\nHottest instructions:\n");
+    for (int i = 0; i < spot_count && i < PROFILE_HOTTEST; i++) {
+        int pc = spots[i].pc;
+        format_instruction(text, sizeof(text), vm->memory, pc);
+        printf("  %02X: %-8s %12llu  %5.1f%%", pc, text, spots[i].count, 100.0 * spots[i].count / total);
+        if (p->taken[pc] || p->not_taken[pc]) {
+            printf("  taken %llu, not taken %llu", p->taken[pc], p->not_taken[pc]);
+        }
+        printf("\n");
+    }
+    
+    if (loop_count) {
+        printf("\nHot loops:\n");
+        for (int i = 0; i < loop_count && i < PROFILE_LOOPS; i++) {
+            int pc = loops[i].pc;
+            unsigned long long back = (vm->memory[pc] & 0xF0) == OP_JMP ? p->exec[pc] : p->taken[pc];
+            printf("  %02X-%02X: %12llu instructions  %5.1f%%  back edge taken %llu times\n",
+                   vm->memory[(unsigned char)(pc + 1)], pc, loops[i].count,
+                   100.0 * loops[i].count / total, back);
+        }
+    }
+    
+    printf("\nOpcodes:\n");
+    for (int op = 0; op < 16; op++) {
+        if (p->opcodes[op]) {
+            printf("  %-4s %12llu  %5.1f%%\n", opcode_names[op], p->opcodes[op], 100.0 * p->opcodes[op] / total);
+        }
+    }
+}
+
+// Total clock cycles of the instructions counted in a profile
+unsigned long long profile_cycles(const Profile *p) {
+    unsigned long long cycles = 0;
+    
+    for (int op = 0; op < 16; op++) {
+        cycles += p->opcodes[op] * opcode_cycles[op];
+    }
+    for (int pc = 0; pc < MEMORY_SIZE; pc++) {
+        cycles += p->taken[pc] * (BRANCH_TAKEN_CYCLES - opcode_cycles[OP_JN >> 4]);
+    }
+    return cycles;
+}
+
+int instruction_length(unsigned char opcode) {
+    switch (opcode & 0xF0) {
+        case OP_STA: case OP_LDA: case OP_ADD: case OP_OR: case OP_AND:
+        case OP_JMP: case OP_JN: case OP_JZ:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+// Print total cycles and the cycles spent in each basic block. Blocks are
+// split at the entry point, at the targets and fall-throughs of the jumps
+// that actually ran, and after every jump or HLT.
+void print_timing_report(const Profile *p, const NeanderVM *vm, long steps) {
+    unsigned char leader[MEMORY_SIZE] = { 0 };
+    const unsigned char *mem = vm->memory;
+    unsigned long long total = profile_cycles(p);
+    
+    printf("\nCycles: %llu (%.2f per instruction)\n", total, steps > 0 ? (double)total / steps : 0.0);
+    
+    leader[0] = 1;
+    for (int pc = 0; pc < MEMORY_SIZE; pc++) {
+        unsigned char opcode = mem[pc] & 0xF0;
+        unsigned char target = mem[(unsigned char)(pc + 1)];
+        if (!p->exec[pc]) {
+            continue;
+        }
+        if (opcode == OP_JMP || p->taken[pc]) {
+            leader[target] = 1;
+        }
+        if (p->not_taken[pc]) {
+            leader[(unsigned char)(pc + 2)] = 1;
+        }
+    }
+    
+    printf("\nCycles per block:\n");
+    int start = -1;
+    int expected = -1;
+    int last = 0;
+    unsigned long long instructions = 0;
+    unsigned long long cycles = 0;
+    for (int pc = 0; pc <= MEMORY_SIZE; pc++) {
+        if (pc < MEMORY_SIZE && !p->exec[pc]) {
+            continue;
+        }
+        if (start >= 0 && (pc == MEMORY_SIZE || pc != expected || leader[pc])) {
+            printf("  %02X-%02X: entered %10llu times %12llu instr %14llu cycles  %5.1f%%\n",
+                   start, last, p->exec[start], instructions, cycles,
+                   total ? 100.0 * cycles / total : 0.0);
+            start = -1;
+        }
+        if (pc == MEMORY_SIZE) {
+            break;
+        }
+        if (start < 0) {
+            start = pc;
+            instructions = 0;
+            cycles = 0;
+        }
+        
+        unsigned char opcode = mem[pc] & 0xF0;
+        instructions += p->exec[pc];
+        cycles += p->exec[pc] * opcode_cycles[opcode >> 4] +
+                  p->taken[pc] * (BRANCH_TAKEN_CYCLES - opcode_cycles[opcode >> 4]);
+        last = pc;
+        expected = pc + instruction_length(opcode);
+        if (opcode == OP_JMP || opcode == OP_JN || opcode == OP_JZ || opcode == OP_HLT) {
+            expected = -1;
+        }
+    }
+}
+
+void fprint_counts(FILE *out, const char *name, const unsigned long long *counts, int n) {
+    fprintf(out, "\"%s\": [", name);
+    for (int i = 0; i < n; i++) {
+        fprintf(out, i ? ", %llu" : "%llu", counts[i]);
+    }
+    fprintf(out, "]");
+}
+
+// Write the profile's fields as JSON members, without the enclosing braces
+void write_profile(FILE *out, const Profile *p, long steps) {
+    fprintf(out, "\"steps\": %ld, \"cycles\": %llu, \"opcodes\": {", steps, profile_cycles(p));
+    int first = 1;
+    for (int op = 0; op < 16; op++) {
+        if (p->opcodes[op]) {
+            fprintf(out, "%s\"%s\": %llu", first ? "" : ", ", opcode_names[op], p->opcodes[op]);
+            first = 0;
+        }
+    }
+    fprintf(out, "}, ");
+    fprint_counts(out, "exec", p->exec, MEMORY_SIZE);
+    fprintf(out, ", ");
+    fprint_counts(out, "taken", p->taken, MEMORY_SIZE);
+    fprintf(out, ", ");
+    fprint_counts(out, "not_taken", p->not_taken, MEMORY_SIZE);
+    fprintf(out, ", ");
+    fprint_counts(out, "reads", p->reads, MEMORY_SIZE);
+    fprintf(out, ", ");
+    fprint_counts(out, "writes", p->writes, MEMORY_SIZE);
+}
+
+// Run under the threaded engine with profiling. Prints the hottest code and
+// saves the profile when 'output' is set, and prints the timing report when
+// 'timing' is set. A non-zero 'max_cycles' replaces the step limit: every
+// instruction that starts before the budget is spent runs to completion.
+int run_profiled(NeanderVM *vm, int max_steps, long long max_cycles, const char *output,
+                 int timing) {
+    DecodeCache cache;
+    Profile *profile = calloc(1, sizeof(Profile));
+    FILE *out = NULL;
+    int halted = 0;
+    long steps = 0;
+    
+    if (!profile) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(1);
+    }
+    if (output) {
+        out = fopen(output, "w");
+        if (!out) {
+            fprintf(stderr, "Error: Cannot open profile file %s\n", output);
+            free(profile);
+            return 1;
+        }
+    }
+    
+    init_cache(&cache);
+    cache.profile = profile;
+    printf("Starting execution...\n");
+    if (max_cycles > 0) {
+        // Slices short enough that even all-8-cycle instructions cannot start
+        // past the budget; they shrink geometrically as the budget runs out
+        unsigned long long cycles = 0;
+        while (!halted && cycles < (unsigned long long)max_cycles) {
+            long slice = (max_cycles - cycles + MAX_INSTRUCTION_CYCLES - 1) / MAX_INSTRUCTION_CYCLES;
+            steps += run_threaded(vm, &cache, slice, &halted);
+            cycles = profile_cycles(profile);
+        }
+    } else {
+        steps = run_threaded(vm, &cache, max_steps, &halted);
+    }
+    print_summary(vm, steps);
+    if (timing) {
+        print_timing_report(profile, vm, steps);
+    }
+    
+    if (out) {
+        print_profile_report(profile, vm, steps);
+        fprintf(out, "{");
+        write_profile(out, profile, steps);
+        fprintf(out, "}\n");
+        fclose(out);
+        printf("\nProfile written to %s\n", output);
+    }
+    free(profile);
+    return 0;
+}
+
+// Run under the threaded engine, recording every step to a trace file
+int run_traced(NeanderVM *vm, int max_steps, const char *path) {
+    DecodeCache cache;
+    TraceFlusher *flusher = trace_flusher_create(TRACE_POOL_CHUNKS);
+    TraceWriter *trace = trace_open(flusher, path, vm);
+    int halted;
+    
+    if (!trace) {
+        fprintf(stderr, "Error: Cannot open trace file %s\n", path);
+        trace_flusher_finish(flusher);
+        return 1;
+    }
+    
+    init_cache(&cache);
+    cache.trace = trace;
+    printf("Starting execution...\n");
+    long steps = run_threaded(vm, &cache, max_steps, &halted);
+    trace->steps = steps;
+    trace_close(trace);
+    int status = trace_flusher_finish(flusher);
+    print_summary(vm, steps);
+    
+    if (status < 0) {
+        fprintf(stderr, "Error: Cannot write trace file %s\n", path);
+    } else {
+        printf("\nTrace: %ld steps in %llu bytes (%.3f bytes/step) written to %s\n",
+               steps, trace->bytes, steps ? (double)trace->bytes / steps : 0.0, path);
+    }
+    free(trace);
+    return status < 0 ? 1 : 0;
+}
+
+// Apply one step record; returns the number of bytes it used, or -1 if
+// the record runs past 'end'
+int trace_apply(NeanderVM *vm, const unsigned char *r, const unsigned char *end) {
+    const unsigned char *p = r + 1;
+    unsigned char tag = r[0];
+    int need = 1 + ((tag & TRACE_PC_MASK) == TRACE_PC_JUMP) + !!(tag & TRACE_AC) + 2 * !!(tag & TRACE_WRITE);
+    
+    if (end - r < need) {
+        return -1;
+    }
+    switch (tag & TRACE_PC_MASK) {
+        case TRACE_PC_NEXT2: vm->PC += 2; break;
+        case TRACE_PC_NEXT1: vm->PC += 1; break;
+        case TRACE_PC_JUMP:  vm->PC = *p++; break;
+        default: break;
+    }
+    if (tag & TRACE_AC) {
+        vm->accumulator += *p++;
+    }
+    if (tag & (TRACE_AC | TRACE_FLAGS)) {
+        update_flags(vm);
+    }
+    if (tag & TRACE_WRITE) {
+        vm->memory[p[0]] = p[1];
+        p += 2;
+    }
+    return need;
+}
+
+// replay <trace> [step]: rebuild the machine state after 'step' steps
+// (default: the end of the trace) from the recorded deltas alone
+int run_replay(int argc, char *argv[]) {
+    unsigned char header[TRACE_HEADER_SIZE];
+    unsigned char sizes[8];
+    NeanderVM vm;
+    long target = -1;
+    long steps = 0;
+    int status = 0;
+    
+    if (argc < 3) {
+        fprintf(stderr, "Error: Usage: %s replay <trace> [step]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 3) {
+        target = atol(argv[3]);
+    }
+    FILE *file = fopen(argv[2], "rb");
+    if (!file) {
+        fprintf(stderr, "Error: Cannot open trace file %s\n", argv[2]);
+        return 1;
+    }
+    if (fread(header, 1, sizeof(header), file) != sizeof(header) ||
+        memcmp(header, TRACE_MAGIC, 4) != 0 || header[4] != TRACE_VERSION) {
+        fprintf(stderr, "Error: %s is not a trace file\n", argv[2]);
+        fclose(file);
+        return 1;
+    }
+    init_vm(&vm);
+    memcpy(vm.memory, header + 8, MEMORY_SIZE);
+    vm.accumulator = header[8 + MEMORY_SIZE];
+    vm.PC = header[9 + MEMORY_SIZE];
+    vm.N = header[10 + MEMORY_SIZE];
+    vm.Z = header[11 + MEMORY_SIZE];
+    
+    unsigned char *packed = malloc(LZ_BOUND(TRACE_CHUNK_SIZE));
+    unsigned char *chunk = malloc(TRACE_CHUNK_SIZE);
+    if (!packed || !chunk) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(1);
+    }
+    while (steps != target && fread(sizes, 1, sizeof(sizes), file) == sizeof(sizes)) {
+        unsigned int raw = get32(sizes);
+        unsigned int size = get32(sizes + 4);
+        long length;
+        if (raw > TRACE_CHUNK_SIZE || size > LZ_BOUND(TRACE_CHUNK_SIZE) ||
+            fread(packed, 1, size, file) != size ||
+            (length = lz_decompress(packed, size, chunk, TRACE_CHUNK_SIZE)) != (long)raw) {
+            fprintf(stderr, "Error: Corrupt trace chunk after step %ld\n", steps);
+            status = 1;
+            break;
+        }
+        for (long i = 0; i < length && steps != target; steps++) {
+            int used = trace_apply(&vm, chunk + i, chunk + length);
+            if (used < 0) {
+                fprintf(stderr, "Error: Corrupt trace record after step %ld\n", steps);
+                status = 1;
+                break;
+            }
+            i += used;
+        }
+        if (status) {
+            break;
+        }
+    }
+    fclose(file);
+    free(packed);
+    free(chunk);
+    
+    if (target >= 0 && steps < target) {
+        fprintf(stderr, "Error: Trace ends at step %ld\n", steps);
+        status = 1;
+    }
+    printf("State after step %ld:\n", steps);
+    print_state(&vm);
+    printf("\nData values:\n");
+    dump_memory(&vm, 0x80, 0x8F);
+    return status;
+}
+
+// Time-travel debugger. A snapshot of the registers is taken every
+// 'interval' steps; memory is not copied. Instead, when an interval closes,
+// the value each written address had at its start is appended to an undo
+// log, so history costs memory in proportion to the bytes that changed.
+// Going back to any step restores the nearest earlier snapshot by undoing
+// those writes and then re-executes at most 'interval' steps.
+#define DEFAULT_SNAPSHOT_INTERVAL 1024
+
+typedef struct {
+    unsigned char accumulator, PC, N, Z;
+    long undo_start;            // First undo entry of the interval it opens
+} Snapshot;
+
+typedef struct {
+    unsigned char addr;
+    unsigned char value;
+} UndoEntry;
+
+typedef struct {
+    NeanderVM vm;
+    long step;
+    int halted;
+    long interval;
+    Snapshot *snapshots;        // Snapshot j is the state at step j * interval
+    long snapshot_count;
+    long snapshot_capacity;
+    UndoEntry *undo;
+    long undo_count;
+    long undo_capacity;
+    unsigned char dirty[MEMORY_SIZE];   // Written since the latest snapshot
+    unsigned char before[MEMORY_SIZE];  // Their values at the latest snapshot
+    unsigned char breakpoints[MEMORY_SIZE];
+} TimeTravel;
+
+void *grow_array(void *items, long *capacity, size_t item_size) {
+    *capacity = *capacity ? *capacity * 2 : 64;
+    items = realloc(items, *capacity * item_size);
+    if (!items) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(1);
+    }
+    return items;
+}
+
+// Close the current interval and open a new one at the current step
+void tt_snapshot(TimeTravel *tt) {
+    for (int a = 0; a < MEMORY_SIZE; a++) {
+        if (tt->dirty[a]) {
+            if (tt->undo_count == tt->undo_capacity) {
+                tt->undo = grow_array(tt->undo, &tt->undo_capacity, sizeof(UndoEntry));
+            }
+            tt->undo[tt->undo_count].addr = a;
+            tt->undo[tt->undo_count].value = tt->before[a];
+            tt->undo_count++;
+            tt->dirty[a] = 0;
+        }
+    }
+    if (tt->snapshot_count == tt->snapshot_capacity) {
+        tt->snapshots = grow_array(tt->snapshots, &tt->snapshot_capacity, sizeof(Snapshot));
+    }
+    Snapshot *s = &tt->snapshots[tt->snapshot_count++];
+    s->accumulator = tt->vm.accumulator;
+    s->PC = tt->vm.PC;
+    s->N = tt->vm.N;
+    s->Z = tt->vm.Z;
+    s->undo_start = tt->undo_count;
+}
+
+// Execute one step, recording history. Returns 0 once the program halted.
+int tt_step(TimeTravel *tt) {
+    NeanderVM *vm = &tt->vm;
+    
+    if (tt->halted) {
+        return 0;
+    }
+    if (tt->step == tt->snapshot_count * tt->interval) {
+        tt_snapshot(tt);
+    }
+    if ((vm->memory[vm->PC] & 0xF0) == OP_STA) {
+        unsigned char addr = vm->memory[(unsigned char)(vm->PC + 1)];
+        if (!tt->dirty[addr]) {
+            tt->dirty[addr] = 1;
+            tt->before[addr] = vm->memory[addr];
+        }
+    }
+    tt->step++;
+    tt->halted = !step_vm(vm);
+    return !tt->halted;
+}
+
+// Rewind to snapshot j, dropping the history after it
+void tt_restore(TimeTravel *tt, long j) {
+    for (int a = 0; a < MEMORY_SIZE; a++) {
+        if (tt->dirty[a]) {
+            tt->vm.memory[a] = tt->before[a];
+            tt->dirty[a] = 0;
+        }
+    }
+    tt->undo_count = tt->snapshots[j].undo_start;
+    for (long i = tt->snapshot_count - 1; i > j; i--) {
+        for (long e = tt->snapshots[i].undo_start - 1; e >= tt->snapshots[i - 1].undo_start; e--) {
+            tt->vm.memory[tt->undo[e].addr] = tt->undo[e].value;
+        }
+    }
+    
+    Snapshot *s = &tt->snapshots[j];
+    tt->vm.accumulator = s->accumulator;
+    tt->vm.PC = s->PC;
+    tt->vm.N = s->N;
+    tt->vm.Z = s->Z;
+    tt->step = j * tt->interval;
+    tt->snapshot_count = j;     // Snapshot j is taken again by the next step
+    tt->halted = 0;
+}
+
+// Move to an earlier step
+void tt_goto(TimeTravel *tt, long target) {
+    if (target >= tt->step) {
+        return;
+    }
+    tt_restore(tt, target / tt->interval);
+    while (tt->step < target) {
+        tt_step(tt);
+    }
+}
+
+// Find the latest step before the current one that stopped at a
+// breakpoint, scanning back one interval at a time. Returns -1 if none.
+long tt_find_breakpoint(TimeTravel *tt) {
+    long end = tt->step;
+    
+    for (long j = (end - 1) / tt->interval; j >= 0 && end > 0; j--) {
+        long found = -1;
+        tt_restore(tt, j);
+        while (tt->step < end) {
+            if (tt->breakpoints[tt->vm.PC]) {
+                found = tt->step;
+            }
+            tt_step(tt);
+        }
+        if (found >= 0) {
+            return found;
+        }
+        end = j * tt->interval;
+    }
+    return -1;
+}
+
+void tt_show(const TimeTravel *tt) {
+    char text[16];
+    
+    format_instruction(text, sizeof(text), tt->vm.memory, tt->vm.PC);
+    printf("Step %ld: AC: %02X  PC: %02X  N: %d  Z: %d  next: %s%s\n",
+           tt->step, tt->vm.accumulator, tt->vm.PC, tt->vm.N, tt->vm.Z, text,
+           tt->halted ? " (halted)" : "");
+}
+
+void print_debug_help(void) {
+    printf("Commands:\n");
+    printf("  s, step [N]              Execute N steps (default 1)\n");
+    printf("  c, continue              Run to the next breakpoint, HLT or the step limit\n");
+    printf("  rs, reverse-step [N]     Go back N steps (default 1)\n");
+    printf("  rc, reverse-continue     Go back to the previous breakpoint hit\n");
+    printf("  b, break ADDR            Stop before executing the instruction at ADDR (hex)\n");
+    printf("  d, delete ADDR           Remove a breakpoint\n");
+    printf("  p, print                 Show the current state\n");
+    printf("  m, memory [FROM [TO]]    Dump memory (hex, default 80 8F)\n");
+    printf("  i, info                  Show history size\n");
+    printf("  q, quit                  Leave the debugger\n");
+}
+
+// Interactive debugger reading commands from stdin
+int run_debugger(NeanderVM *vm, long max_steps, long interval) {
+    TimeTravel *tt = calloc(1, sizeof(TimeTravel));
+    char line[256];
+    int prompt = isatty(STDIN_FILENO);
+    
+    if (!tt) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(1);
+    }
+    tt->vm = *vm;
+    tt->interval = interval > 0 ? interval : DEFAULT_SNAPSHOT_INTERVAL;
+    
+    printf("Time-travel debugger, snapshot every %ld steps. Type 'help' for commands.\n", tt->interval);
+    tt_show(tt);
+    for (;;) {
+        if (prompt) {
+            printf("(neander) ");
+            fflush(stdout);
+        }
+        if (!fgets(line, sizeof(line), stdin)) {
+            break;
+        }
+        char command[32] = "";
+        char arg1[32] = "";
+        char arg2[32] = "";
+        if (sscanf(line, "%31s %31s %31s", command, arg1, arg2) < 1) {
+            continue;
+        }
+        long count = arg1[0] ? atol(arg1) : 1;
+        
+        if (strcmp(command, "s") == 0 || strcmp(command, "step") == 0) {
+            for (long i = 0; i < count && tt_step(tt); i++) {
+            }
+            tt_show(tt);
+        } else if (strcmp(command, "c") == 0 || strcmp(command, "continue") == 0) {
+            while (tt_step(tt) && !tt->breakpoints[tt->vm.PC] &&
+                   (max_steps == 0 || tt->step < max_steps)) {
+            }
+            if (!tt->halted && max_steps > 0 && tt->step >= max_steps && !tt->breakpoints[tt->vm.PC]) {
+                printf("Step limit reached\n");
+            }
+            tt_show(tt);
+        } else if (strcmp(command, "rs") == 0 || strcmp(command, "reverse-step") == 0) {
+            tt_goto(tt, count < tt->step ? tt->step - count : 0);
+            tt_show(tt);
+        } else if (strcmp(command, "rc") == 0 || strcmp(command, "reverse-continue") == 0) {
+            long found = tt_find_breakpoint(tt);
+            if (found < 0) {
+                printf("No earlier breakpoint hit\n");
+                tt_goto(tt, 0);
+            } else {
+                tt_goto(tt, found);
+            }
+            tt_show(tt);
+        } else if (strcmp(command, "b") == 0 || strcmp(command, "break") == 0 ||
+                   strcmp(command, "d") == 0 || strcmp(command, "delete") == 0) {
+            if (!arg1[0]) {
+                printf("Breakpoints:");
+                for (int a = 0; a < MEMORY_SIZE; a++) {
+                    if (tt->breakpoints[a]) {
+                        printf(" %02X", a);
+                    }
+                }
+                printf("\n");
+            } else {
+                tt->breakpoints[strtol(arg1, NULL, 16) & 0xFF] = command[0] == 'b';
+            }
+        } else if (strcmp(command, "p") == 0 || strcmp(command, "print") == 0) {
+            tt_show(tt);
+        } else if (strcmp(command, "m") == 0 || strcmp(command, "memory") == 0) {
+            int from = arg1[0] ? (int)(strtol(arg1, NULL, 16) & 0xFF) : 0x80;
+            int to = arg2[0] ? (int)(strtol(arg2, NULL, 16) & 0xFF) : (arg1[0] ? from + 15 : 0x8F);
+            dump_memory(&tt->vm, from, to < MEMORY_SIZE ? to : MEMORY_SIZE - 1);
+        } else if (strcmp(command, "i") == 0 || strcmp(command, "info") == 0) {
+            printf("%ld snapshots, %ld undo entries (%zu bytes of history)\n",
+                   tt->snapshot_count, tt->undo_count,
+                   tt->snapshot_count * sizeof(Snapshot) + tt->undo_count * sizeof(UndoEntry));
+        } else if (strcmp(command, "q") == 0 || strcmp(command, "quit") == 0) {
+            break;
+        } else if (strcmp(command, "h") == 0 || strcmp(command, "help") == 0) {
+            print_debug_help();
+        } else {
+            printf("Unknown command '%s'. Type 'help' for commands.\n", command);
+        }
+    }
+    
+    free(tt->snapshots);
+    free(tt->undo);
+    free(tt);
+    return 0;
+}
+
+// Cooperative scheduler hosting many VMs on one thread (--sessions). Each
+// VM is a task that runs one quantum of steps and then yields to the next
+// task in the ready ring. A switch is only a move to the next index, since
+// the NeanderVM itself is the whole task state. Commands on stdin are
+// checked between quanta, so suspend, resume and inspect answer promptly
+// however many VMs are running.
+#define DEFAULT_QUANTUM 1000
+#define SESSION_POLL_QUANTA 64      // Quanta run between checks for commands
+
+typedef enum {
+    TASK_READY,
+    TASK_SUSPENDED,
+    TASK_HALTED,
+    TASK_STEP_LIMIT,
+    TASK_KILLED,
+    TASK_STATES
+} TaskState;
+
+const char *task_state_names[TASK_STATES] = { "ready", "suspended", "halted", "step_limit", "killed" };
+
+typedef struct {
+    NeanderVM vm;
+    unsigned char state;
+    int next, prev;                 // Ready ring links
+    long steps;
+} Task;
+
+typedef struct {
+    Task *tasks;
+    long count;
+    long capacity;
+    int current;                    // Task to run next, -1 if none is ready
+    long max_steps;                 // Per task, 0 for no limit
+    long quantum;
+} Scheduler;
+
+// Put a task at the end of the round
+void sched_enqueue(Scheduler *s, int id) {
+    Task *t = &s->tasks[id];
+    
+    t->state = TASK_READY;
+    if (s->current < 0) {
+        t->next = t->prev = id;
+        s->current = id;
+        return;
+    }
+    Task *head = &s->tasks[s->current];
+    t->next = s->current;
+    t->prev = head->prev;
+    s->tasks[head->prev].next = id;
+    head->prev = id;
+}
+
+void sched_dequeue(Scheduler *s, int id, TaskState state) {
+    Task *t = &s->tasks[id];
+    
+    t->state = state;
+    if (t->next == id) {
+        s->current = -1;
+        return;
+    }
+    s->tasks[t->prev].next = t->next;
+    s->tasks[t->next].prev = t->prev;
+    if (s->current == id) {
+        s->current = t->next;
+    }
+}
+
+// Run the current task for one quantum and move on to the next
+void sched_run_quantum(Scheduler *s) {
+    int id = s->current;
+    Task *t = &s->tasks[id];
+    long budget = s->quantum;
+    int halted;
+    
+    if (s->max_steps > 0 && s->max_steps - t->steps < budget) {
+        budget = s->max_steps - t->steps;
+    }
+    t->steps += run_switch(&t->vm, NULL, budget, &halted);
+    if (halted) {
+        sched_dequeue(s, id, TASK_HALTED);
+    } else if (s->max_steps > 0 && t->steps >= s->max_steps) {
+        sched_dequeue(s, id, TASK_STEP_LIMIT);
+    } else {
+        s->current = t->next;
+    }
+}
+
+// Line-buffered reader on stdin that can be asked not to block
+typedef struct {
+    char buffer[4096];
+    size_t start, end;
+    int eof;
+} CommandReader;
+
+// Returns 1 with the next line in 'line', 0 if none is available without
+// blocking (only when 'wait' is 0), or -1 at end of input
+int read_command(CommandReader *r, char *line, size_t size, int wait) {
+    for (;;) {
+        char *newline = memchr(r->buffer + r->start, '\n', r->end - r->start);
+        int full = r->start == 0 && r->end == sizeof(r->buffer);
+        if (newline || full || (r->eof && r->start < r->end)) {
+            size_t length = newline ? (size_t)(newline - (r->buffer + r->start)) : r->end - r->start;
+            size_t copied = length < size - 1 ? length : size - 1;
+            memcpy(line, r->buffer + r->start, copied);
+            line[copied] = '\0';
+            r->start += length + (newline != NULL);
+            return 1;
+        }
+        if (r->eof) {
+            return -1;
+        }
+        if (!wait) {
+            struct pollfd p = { STDIN_FILENO, POLLIN, 0 };
+            if (poll(&p, 1, 0) <= 0) {
+                return 0;
+            }
+        }
+        memmove(r->buffer, r->buffer + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+        ssize_t got = read(STDIN_FILENO, r->buffer + r->end, sizeof(r->buffer) - r->end);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            r->eof = 1;
+        } else {
+            r->end += got;
+        }
+    }
+}
+
+void print_session_help(void) {
+    printf("Commands:\n");
+    printf("  load FILE [N]            Start N VMs (default 1) from image FILE\n");
+    printf("  suspend ID|all           Stop scheduling a VM\n");
+    printf("  resume ID|all            Schedule a suspended VM again\n");
+    printf("  kill ID                  Stop a VM for good\n");
+    printf("  inspect ID [FROM [TO]]   Show a VM's state and memory (hex, default 80 8F)\n");
+    printf("  list                     Count VMs by state\n");
+    printf("  quantum N                Steps a VM runs before yielding\n");
+    printf("  wait                     Run until no VM is ready\n");
+    printf("  quit                     Leave, discarding all VMs\n");
+}
+
+void print_session_list(const Scheduler *s) {
+    long counts[TASK_STATES] = { 0 };
+    long long steps = 0;
+    
+    for (long i = 0; i < s->count; i++) {
+        counts[s->tasks[i].state]++;
+        steps += s->tasks[i].steps;
+    }
+    printf("%ld VMs (%zu bytes each), %lld steps run:", s->count, sizeof(Task), steps);
+    for (int k = 0; k < TASK_STATES; k++) {
+        printf(" %s %ld", task_state_names[k], counts[k]);
+    }
+    printf("\n");
+}
+
+// Parse a VM id; prints an error and returns -1 if there is no such VM
+int session_id(const Scheduler *s, const char *arg) {
+    char *end;
+    long id = strtol(arg, &end, 10);
+    
+    if (!arg[0] || *end || id < 0 || id >= s->count) {
+        printf("No VM '%s'\n", arg);
+        return -1;
+    }
+    return id;
+}
+
+int run_sessions(long max_steps, long quantum) {
+    Scheduler s = { NULL, 0, 0, -1, max_steps, quantum > 0 ? quantum : DEFAULT_QUANTUM };
+    CommandReader *reader = calloc(1, sizeof(CommandReader));
+    char line[512];
+    int prompt = isatty(STDIN_FILENO);
+    
+    if (!reader) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(1);
+    }
+    printf("VM scheduler, quantum %ld steps. Type 'help' for commands.\n", s.quantum);
+    for (;;) {
+        if (prompt && s.current < 0) {
+            printf("(sessions) ");
+        }
+        fflush(stdout);
+        int got = read_command(reader, line, sizeof(line), s.current < 0);
+        if (got < 0 && s.current < 0) {
+            break;
+        }
+        if (got <= 0) {
+            // Nothing to do but run: a batch of quanta, then look again
+            for (int q = 0; q < SESSION_POLL_QUANTA && s.current >= 0; q++) {
+                sched_run_quantum(&s);
+            }
+            continue;
+        }
+        
+        char command[32] = "";
+        char arg1[PATH_MAX] = "";
+        char arg2[32] = "";
+        char arg3[32] = "";
+        if (sscanf(line, "%31s %4095s %31s %31s", command, arg1, arg2, arg3) < 1) {
+            continue;
+        }
+        
+        if (strcmp(command, "load") == 0) {
+            NeanderVM image;
+            long count = arg2[0] ? atol(arg2) : 1;
+            init_vm(&image);
+            if (read_image(&image, arg1) < 0) {
+                printf("Cannot open image %s\n", arg1);
+                continue;
+            }
+            if (count < 1 || s.count + count > INT_MAX) {
+                printf("Bad VM count %s\n", arg2);
+                continue;
+            }
+            long first = s.count;
+            for (long i = 0; i < count; i++) {
+                if (s.count == s.capacity) {
+                    s.tasks = grow_array(s.tasks, &s.capacity, sizeof(Task));
+                }
+                Task *t = &s.tasks[s.count];
+                t->vm = image;
+                t->steps = 0;
+                sched_enqueue(&s, s.count++);
+            }
+            printf("Loaded VMs %ld-%ld from %s\n", first, s.count - 1, arg1);
+        } else if (strcmp(command, "suspend") == 0 || strcmp(command, "resume") == 0) {
+            int suspend = command[0] == 's';
+            int all = strcmp(arg1, "all") == 0;
+            long from = all ? 0 : session_id(&s, arg1);
+            long to = all ? s.count - 1 : from;
+            long changed = 0;
+            for (long id = from; id >= 0 && id <= to; id++) {
+                TaskState state = s.tasks[id].state;
+                if (suspend && state == TASK_READY) {
+                    sched_dequeue(&s, id, TASK_SUSPENDED);
+                    changed++;
+                } else if (!suspend && state == TASK_SUSPENDED) {
+                    sched_enqueue(&s, id);
+                    changed++;
+                }
+            }
+            if (from >= 0) {
+                printf("%s %ld VMs\n", suspend ? "Suspended" : "Resumed", changed);
+            }
+        } else if (strcmp(command, "kill") == 0) {
+            int id = session_id(&s, arg1);
+            if (id >= 0) {
+                TaskState state = s.tasks[id].state;
+                if (state == TASK_READY) {
+                    sched_dequeue(&s, id, TASK_KILLED);
+                    printf("Killed VM %d\n", id);
+                } else if (state == TASK_SUSPENDED) {
+                    s.tasks[id].state = TASK_KILLED;
+                    printf("Killed VM %d\n", id);
+                } else {
+                    // Halted, step-limited and killed VMs keep their state
+                    printf("VM %d already finished (%s)\n", id, task_state_names[state]);
+                }
+            }
+        } else if (strcmp(command, "inspect") == 0) {
+            int id = session_id(&s, arg1);
+            if (id >= 0) {
+                Task *t = &s.tasks[id];
+                int from = arg2[0] ? (int)(strtol(arg2, NULL, 16) & 0xFF) : 0x80;
+                int to = arg3[0] ? (int)(strtol(arg3, NULL, 16) & 0xFF) : (arg2[0] ? from + 15 : 0x8F);
+                printf("VM %d: %s after %ld steps\n", id, task_state_names[t->state], t->steps);
+                print_state(&t->vm);
+                dump_memory(&t->vm, from, to < MEMORY_SIZE ? to : MEMORY_SIZE - 1);
+            }
+        } else if (strcmp(command, "list") == 0) {
+            print_session_list(&s);
+        } else if (strcmp(command, "quantum") == 0) {
+            if (atol(arg1) > 0) {
+                s.quantum = atol(arg1);
+            }
+            printf("Quantum %ld steps\n", s.quantum);
+        } else if (strcmp(command, "wait") == 0) {
+            while (s.current >= 0) {
+                sched_run_quantum(&s);
+            }
+            print_session_list(&s);
+        } else if (strcmp(command, "q") == 0 || strcmp(command, "quit") == 0) {
+            break;
+        } else if (strcmp(command, "h") == 0 || strcmp(command, "help") == 0) {
+            print_session_help();
+        } else {
+            printf("Unknown command '%s'. Type 'help' for commands.\n", command);
+        }
+    }
+    
+    free(s.tasks);
+    free(reader);
+    return 0;
+}
+
+double elapsed_seconds(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Run the loaded image repeatedly under one engine and print its speed.
+// The final state of the last run is left in *out for cross-checking.
+double bench_engine(const char *name, EngineFn engine, const NeanderVM *image,
+                    long max_steps, long runs, NeanderVM *out, long *steps_out) {
+    struct timespec start;
+    DecodeCache cache;
+    long total = 0;
+    long steps = 0;
+    int halted;
+    
+    init_cache(&cache);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long r = 0; r < runs; r++) {
+        *out = *image;
+        steps = engine(out, &cache, max_steps, &halted);
+        total += steps;
+        rewind_cache(&cache);
+    }
+    double secs = elapsed_seconds(&start);
+    
+    double ips = secs > 0 ? total / secs : 0;
+    printf("  %-10s %12ld instr  %8.3f s  %10.2f Minstr/s\n", name, total, secs, ips / 1e6);
+    *steps_out = steps;
+    return ips;
+}
+
+int same_state(const NeanderVM *a, const NeanderVM *b) {
+    return memcmp(a->memory, b->memory, MEMORY_SIZE) == 0 &&
+           a->accumulator == b->accumulator && a->PC == b->PC &&
+           a->N == b->N && a->Z == b->Z;
+}
+
+typedef struct {
+    const char *name;
+    EngineFn fn;
+} EngineInfo;
+
+// Engines selectable with --engine; the first entry is the reference
+const EngineInfo engines[] = {
+    { "switch", run_switch },
+    { "threaded", run_threaded },
+#ifdef HAVE_JIT
+    { "jit", run_jit_engine },
+#endif
+};
+#define ENGINE_COUNT ((int)(sizeof(engines) / sizeof(engines[0])))
+
+// Compare every engine against the switch loop on the loaded image
+int run_benchmark(const NeanderVM *image, long max_steps) {
+    NeanderVM ref, fast;
+    long ref_steps, fast_steps;
+    int halted;
+    int status = 0;
+    
+    // Size the run count from one reference run, aiming at ~50M instructions
+    ref = *image;
+    long per_run = run_switch(&ref, NULL, max_steps, &halted);
+    long runs = per_run > 0 ? 50000000 / per_run : 1;
+    if (runs < 1) {
+        runs = 1;
+    }
+    
+    printf("Benchmark: %ld runs of %ld steps\n", runs, per_run);
+    double ref_ips = bench_engine(engines[0].name, engines[0].fn, image, max_steps,
+                                  runs, &ref, &ref_steps);
+    
+    for (int e = 1; e < ENGINE_COUNT; e++) {
+        double ips = bench_engine(engines[e].name, engines[e].fn, image, max_steps,
+                                  runs, &fast, &fast_steps);
+        if (ref_steps != fast_steps || !same_state(&ref, &fast)) {
+            fprintf(stderr, "Error: %s engine diverged from the switch loop\n", engines[e].name);
+            status = 1;
+        } else if (ref_ips > 0) {
+            printf("  %-10s speedup %.2fx\n", "", ips / ref_ips);
+        }
+    }
+    return status;
+}
+
+// Brent's cycle detection over the full machine state (memory, AC, PC, N,
+// Z). The machine is deterministic, so a repeated state means it will loop
+// forever. States are compared by an incrementally updated hash and only
+// compared byte for byte when the hashes agree.
+typedef struct {
+    NeanderVM initial;              // Start state, used to locate the loop entry
+    NeanderVM saved;                // Brent's tortoise
+    unsigned long long saved_hash;
+    unsigned long long memory_hash; // Hash of the current memory, kept up to date
+    long power;
+    long lam;
+    long steps;
+    long loop_start;                // Step at which the loop is entered
+    long period;                    // Loop length in steps, 0 until found
+} LoopDetector;
+
+unsigned long long hash_weights[MEMORY_SIZE];
+pthread_once_t hash_weights_once = PTHREAD_ONCE_INIT;
+
+void init_hash_weights(void) {
+    unsigned long long x = 0x9E3779B97F4A7C15ULL;
+    
+    // splitmix64; odd weights keep every byte value distinct
+    for (int i = 0; i < MEMORY_SIZE; i++) {
+        unsigned long long z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        hash_weights[i] = (z ^ (z >> 31)) | 1;
+    }
+}
+
+unsigned long long memory_hash(const NeanderVM *vm) {
+    unsigned long long hash = 0;
+    
+    for (int i = 0; i < MEMORY_SIZE; i++) {
+        hash += vm->memory[i] * hash_weights[i];
+    }
+    return hash;
+}
+
+unsigned long long state_hash(unsigned long long memory_hash, const NeanderVM *vm) {
+    unsigned long long regs = vm->accumulator | (vm->PC << 8) | (vm->N << 16) | ((unsigned)vm->Z << 24);
+    return memory_hash ^ (regs * 0xD6E8FEB86659FD93ULL);
+}
+
+// step_vm, keeping the memory hash current across stores
+int step_hashed(NeanderVM *vm, unsigned long long *hash) {
+    if ((vm->memory[vm->PC] & 0xF0) == OP_STA) {
+        unsigned char addr = vm->memory[(unsigned char)(vm->PC + 1)];
+        *hash += (vm->accumulator - vm->memory[addr]) * hash_weights[addr];
+    }
+    return step_vm(vm);
+}
+
+void loop_detector_init(LoopDetector *d, const NeanderVM *vm) {
+    pthread_once(&hash_weights_once, init_hash_weights);
+    d->initial = *vm;
+    d->saved = *vm;
+    d->memory_hash = memory_hash(vm);
+    d->saved_hash = state_hash(d->memory_hash, vm);
+    d->power = 1;
+    d->lam = 0;
+    d->steps = 0;
+    d->loop_start = 0;
+    d->period = 0;
+}
+
+// Once the period is known, walk two copies from the start state 'period'
+// steps apart until they meet: that is where the loop is entered
+void loop_detector_locate(LoopDetector *d) {
+    NeanderVM a = d->initial;
+    NeanderVM b = d->initial;
+    unsigned long long hash_a = memory_hash(&a);
+    unsigned long long hash_b = hash_a;
+    
+    for (long i = 0; i < d->period; i++) {
+        step_hashed(&b, &hash_b);
+    }
+    d->loop_start = 0;
+    while (state_hash(hash_a, &a) != state_hash(hash_b, &b) || !same_state(&a, &b)) {
+        step_hashed(&a, &hash_a);
+        step_hashed(&b, &hash_b);
+        d->loop_start++;
+    }
+}
+
+// Run up to 'budget' steps with cycle detection. Returns the steps executed;
+// stops early at HLT (*halted set) or when d->period becomes non-zero.
+// Can be called again to continue a run in slices.
+long loop_detector_run(LoopDetector *d, NeanderVM *vm, long budget, int *halted) {
+    long steps = 0;
+    
+    *halted = 0;
+    while (budget == 0 || steps < budget) {
+        int running = step_hashed(vm, &d->memory_hash);
+        steps++;
+        d->steps++;
+        if (!running) {
+            *halted = 1;
+            break;
+        }
+        
+        d->lam++;
+        unsigned long long hash = state_hash(d->memory_hash, vm);
+        if (hash == d->saved_hash && same_state(vm, &d->saved)) {
+            d->period = d->lam;
+            loop_detector_locate(d);
+            break;
+        }
+        if (d->lam == d->power) {
+            d->saved = *vm;
+            d->saved_hash = hash;
+            d->power *= 2;
+            d->lam = 0;
+        }
+    }
+    return steps;
+}
+
+// Single-program run with --detect-loops
+void run_detect_loops(NeanderVM *vm, long max_steps) {
+    LoopDetector detector;
+    int halted;
+    
+    loop_detector_init(&detector, vm);
+    printf("Starting execution...\n");
+    long steps = loop_detector_run(&detector, vm, max_steps, &halted);
+    if (detector.period) {
+        printf("Infinite loop entered at step %ld, period %ld\n",
+               detector.loop_start, detector.period);
+    }
+    print_summary(vm, steps);
+}
+
+// Coverage-guided fuzzing of the data region (--fuzz). Every run starts
+// from the loaded image with some data bytes mutated and is executed
+// in-process by a bare interpreter that records each PC transition in an
+// edge bitmap; inputs reaching an edge no earlier run reached join the
+// corpus. Between runs only the bytes the last run stored to are restored.
+#define FUZZ_EDGES (MEMORY_SIZE * MEMORY_SIZE)
+#define FUZZ_MAX_CORPUS 4096
+#define FUZZ_MAX_FINDINGS 64
+#define FUZZ_DATA_START 0x80    // INITIAL_MEMORY_ADDRESS in main.c
+#define FUZZ_DATA_END 0xC7      // Up to TEMP_MEMORY_START
+
+typedef enum {
+    TRAP_NONE,          // Reached HLT
+    TRAP_OPCODE,        // Executed an undefined opcode
+    TRAP_WRAP,          // PC ran past 0xFF into 0x00
+    TRAP_BUDGET,        // Step limit reached, e.g. dividing by zero
+    TRAP_KINDS
+} TrapKind;
+
+const char *trap_names[TRAP_KINDS] = { "halt", "opcode", "pc_wrap", "budget" };
+
+typedef struct {
+    TrapKind kind;
+    unsigned char pc;               // Trapping instruction, or loop head for TRAP_BUDGET
+    unsigned char input[MEMORY_SIZE];
+} FuzzFinding;
+
+typedef struct {
+    NeanderVM image;                        // Pristine image
+    NeanderVM vm;
+    long max_steps;
+    unsigned char positions[MEMORY_SIZE];   // Addresses being mutated
+    int position_count;
+    unsigned char written[MEMORY_SIZE];     // Stored to since the last reset
+    unsigned char dirty[MEMORY_SIZE];       // The same addresses, as a list
+    int dirty_count;
+    unsigned char edges[FUZZ_EDGES / 8];
+    long edge_count;
+    unsigned char *corpus;                  // position_count bytes per entry
+    int corpus_count;
+    unsigned char trap_seen[TRAP_KINDS][MEMORY_SIZE];
+    FuzzFinding findings[FUZZ_MAX_FINDINGS];
+    int finding_count;
+    long traps[TRAP_KINDS];
+    unsigned long long rng;
+} Fuzzer;
+
+static inline unsigned long long fuzz_random(Fuzzer *f) {
+    // xorshift64*
+    f->rng ^= f->rng >> 12;
+    f->rng ^= f->rng << 25;
+    f->rng ^= f->rng >> 27;
+    return f->rng * 0x2545F4914F6CDD1DULL;
+}
+
+// Bring the machine back to the image with 'input' in the fuzzed bytes
+void fuzz_reset(Fuzzer *f, const unsigned char *input) {
+    unsigned char *mem = f->vm.memory;
+    
+    for (int i = 0; i < f->dirty_count; i++) {
+        unsigned char addr = f->dirty[i];
+        mem[addr] = f->image.memory[addr];
+        f->written[addr] = 0;
+    }
+    f->dirty_count = 0;
+    for (int i = 0; i < f->position_count; i++) {
+        mem[f->positions[i]] = input[i];
+    }
+    f->vm.accumulator = f->image.accumulator;
+    f->vm.PC = f->image.PC;
+    f->vm.N = f->image.N;
+    f->vm.Z = f->image.Z;
+}
+
+// Run the machine until HLT or a trap. *trap_pc is the trapping
+// instruction, or for TRAP_BUDGET the target of the last backward jump,
+// which identifies the loop that never finished.
+TrapKind fuzz_execute(Fuzzer *f, unsigned char *trap_pc, long *new_edges) {
+    unsigned char *mem = f->vm.memory;
+    unsigned char *edges = f->edges;
+    unsigned char ac = f->vm.accumulator;
+    unsigned char pc = f->vm.PC;
+    unsigned char n = f->vm.N;
+    unsigned char z = f->vm.Z;
+    unsigned char loop_head = pc;
+    
+    for (long steps = 0; steps < f->max_steps; steps++) {
+        unsigned char op = mem[pc] & 0xF0;
+        unsigned char operand = mem[(unsigned char)(pc + 1)];
+        unsigned char next = pc + 2;
+        int jumped = 0;
+        
+        switch (op) {
+        case OP_NOP:
+            next = pc + 1;
+            break;
+        case OP_STA:
+            mem[operand] = ac;
+            if (!f->written[operand]) {
+                f->written[operand] = 1;
+                f->dirty[f->dirty_count++] = operand;
+            }
+            break;
+        case OP_LDA:
+            ac = mem[operand];
+            break;
+        case OP_ADD:
+            ac += mem[operand];
+            break;
+        case OP_OR:
+            ac |= mem[operand];
+            break;
+        case OP_AND:
+            ac &= mem[operand];
+            break;
+        case OP_NOT:
+            ac = ~ac;
+            next = pc + 1;
+            break;
+        case OP_JMP:
+            jumped = 1;
+            break;
+        case OP_JN:
+            jumped = n;
+            break;
+        case OP_JZ:
+            jumped = z;
+            break;
+        case OP_HLT:
+            f->vm.accumulator = ac;
+            f->vm.PC = pc;
+            return TRAP_NONE;
+        default:
+            *trap_pc = pc;
+            return TRAP_OPCODE;
+        }
+        if (op >= OP_LDA && op <= OP_NOT) {
+            n = ac >> 7;
+            z = ac == 0;
+        }
+        if (jumped) {
+            next = operand;
+            if (next <= pc) {
+                loop_head = next;
+            }
+        } else if (next < pc) {
+            *trap_pc = pc;
+            return TRAP_WRAP;
+        }
+        
+        unsigned int edge = pc << 8 | next;
+        if (!(edges[edge >> 3] & (1 << (edge & 7)))) {
+            edges[edge >> 3] |= 1 << (edge & 7);
+            (*new_edges)++;
+        }
+        pc = next;
+    }
+    *trap_pc = loop_head;
+    return TRAP_BUDGET;
+}
+
+// Pick the bytes to fuzz: those in [start, end] the unmodified image reads,
+// or the whole range if it reads none of them
+void fuzz_select_positions(Fuzzer *f, unsigned char start, unsigned char end) {
+    NeanderVM vm = f->image;
+    unsigned char read[MEMORY_SIZE] = { 0 };
+    int found = 0;
+    
+    for (long steps = 0; steps < f->max_steps; steps++) {
+        unsigned char op = vm.memory[vm.PC] & 0xF0;
+        if (op >= OP_LDA && op <= OP_AND) {
+            read[vm.memory[(unsigned char)(vm.PC + 1)]] = 1;
+        }
+        if (!step_vm(&vm)) {
+            break;
+        }
+    }
+    for (int addr = start; addr <= end; addr++) {
+        found |= read[addr];
+    }
+    f->position_count = 0;
+    for (int addr = start; addr <= end; addr++) {
+        if (read[addr] || !found) {
+            f->positions[f->position_count++] = addr;
+        }
+    }
+}
+
+void fuzz_mutate(Fuzzer *f, unsigned char *input) {
+    static const unsigned char interesting[] = { 0x00, 0x01, 0x02, 0x7F, 0x80, 0x81, 0xFF };
+    int count = 1 + fuzz_random(f) % 4;
+    
+    for (int i = 0; i < count; i++) {
+        unsigned long long r = fuzz_random(f);
+        unsigned char *byte = &input[(r >> 8) % f->position_count];
+        switch (r % 6) {
+        case 0:
+            *byte ^= 1 << ((r >> 32) & 7);
+            break;
+        case 1:
+            *byte = r >> 40;
+            break;
+        case 2:
+            *byte = interesting[(r >> 32) % sizeof(interesting)];
+            break;
+        case 3:
+            *byte += 1 + ((r >> 32) & 15);
+            break;
+        case 4:
+            *byte -= 1 + ((r >> 32) & 15);
+            break;
+        default: {
+            // Splice in the same byte from another corpus entry
+            const unsigned char *other = f->corpus + ((r >> 32) % f->corpus_count) * f->position_count;
+            *byte = other[byte - input];
+            break;
+        }
+        }
+    }
+}
+
+void fuzz_record_trap(Fuzzer *f, TrapKind kind, unsigned char pc, const unsigned char *input,
+                      const char *findings_dir) {
+    f->traps[kind]++;
+    if (f->trap_seen[kind][pc] || f->finding_count == FUZZ_MAX_FINDINGS) {
+        return;
+    }
+    f->trap_seen[kind][pc] = 1;
+    FuzzFinding *finding = &f->findings[f->finding_count++];
+    finding->kind = kind;
+    finding->pc = pc;
+    memcpy(finding->input, input, f->position_count);
+    
+    if (findings_dir) {
+        char path[PATH_MAX];
+        NeanderVM vm = f->image;
+        for (int i = 0; i < f->position_count; i++) {
+            vm.memory[f->positions[i]] = input[i];
+        }
+        snprintf(path, sizeof(path), "%s/%s-%02X.bin", findings_dir, trap_names[kind], pc);
+        FILE *file = fopen(path, "wb");
+        if (!file || fwrite(vm.memory, 1, MEMORY_SIZE, file) != MEMORY_SIZE) {
+            fprintf(stderr, "Error: Cannot write %s\n", path);
+        }
+        if (file) {
+            fclose(file);
+        }
+    }
+}
+
+// Fuzz the data bytes of 'image' in [start, end] for 'runs' runs
+int run_fuzzer(const NeanderVM *image, long runs, long max_steps, unsigned char start,
+               unsigned char end, unsigned long long seed, const char *findings_dir) {
+    if (max_steps <= 0) {
+        fprintf(stderr, "Error: --fuzz needs a step limit\n");
+        return 1;
+    }
+    if (start > end) {
+        fprintf(stderr, "Error: Empty fuzzing range %02X:%02X\n", start, end);
+        return 1;
+    }
+    Fuzzer *f = calloc(1, sizeof(Fuzzer));
+    if (!f) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return 1;
+    }
+    f->image = *image;
+    f->vm = *image;
+    f->max_steps = max_steps;
+    f->rng = seed ? seed : 0x9E3779B97F4A7C15ULL;
+    fuzz_select_positions(f, start, end);
+    f->corpus = malloc((size_t)FUZZ_MAX_CORPUS * f->position_count);
+    if (!f->corpus) {
+        fprintf(stderr, "Error: Out of memory\n");
+        free(f);
+        return 1;
+    }
+    
+    printf("Fuzzing %d bytes in %02X-%02X, %ld steps per run\n",
+           f->position_count, start, end, max_steps);
+    
+    // The image's own data is the first corpus entry
+    unsigned char input[MEMORY_SIZE];
+    for (int i = 0; i < f->position_count; i++) {
+        input[i] = image->memory[f->positions[i]];
+    }
+    memcpy(f->corpus, input, f->position_count);
+    f->corpus_count = 1;
+    
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (long r = 0; r < runs; r++) {
+        unsigned char trap_pc = 0;
+        long new_edges = 0;
+        
+        if (r > 0) {
+            memcpy(input, f->corpus + (fuzz_random(f) % f->corpus_count) * f->position_count,
+                   f->position_count);
+            fuzz_mutate(f, input);
+        }
+        fuzz_reset(f, input);
+        TrapKind kind = fuzz_execute(f, &trap_pc, &new_edges);
+        if (new_edges) {
+            f->edge_count += new_edges;
+            if (r > 0 && f->corpus_count < FUZZ_MAX_CORPUS) {
+                memcpy(f->corpus + f->corpus_count++ * f->position_count, input, f->position_count);
+            }
+        }
+        if (kind != TRAP_NONE) {
+            fuzz_record_trap(f, kind, trap_pc, input, findings_dir);
+        }
+    }
+    double secs = elapsed_seconds(&begin);
+    
+    printf("Runs: %ld in %.3f s (%.0f runs/s)\n", runs, secs, secs > 0 ? runs / secs : 0);
+    printf("Edges: %ld, corpus: %d inputs\n", f->edge_count, f->corpus_count);
+    printf("Traps:");
+    for (int k = TRAP_OPCODE; k < TRAP_KINDS; k++) {
+        printf(" %s %ld", trap_names[k], f->traps[k]);
+    }
+    printf("\n");
+    for (int i = 0; i < f->finding_count; i++) {
+        const FuzzFinding *finding = &f->findings[i];
+        printf("  %-8s at %02X:", trap_names[finding->kind], finding->pc);
+        for (int p = 0; p < f->position_count; p++) {
+            if (finding->input[p] != image->memory[f->positions[p]]) {
+                printf(" [%02X]=%02X", f->positions[p], finding->input[p]);
+            }
+        }
+        printf("\n");
+    }
+    if (f->finding_count == FUZZ_MAX_FINDINGS) {
+        printf("  (further distinct traps not listed)\n");
+    }
+    
+    free(f->corpus);
+    free(f);
+    return 0;
+}
+
+// Shared-memory multiprocessor (--cores N). Every simulated core has its
+// own AC/PC/N/Z, starts with its core number in AC and runs on its own
+// host thread. Cores advance in rounds of one quantum separated by
+// barriers, and the consistency model decides when stores become visible:
+//   bsp  each core runs its quantum against memory as it was at the last
+//        barrier plus its own stores; at the barrier the stores are merged
+//        in core order, so the highest-numbered core wins a conflict
+//   sc   cores take turns, running their quanta one after another on the
+//        shared memory; quantum 1 interleaves single instructions
+// In both, the result does not depend on how the host schedules threads.
+#define MAX_CORES 64
+
+typedef enum {
+    CONSISTENCY_BSP,
+    CONSISTENCY_SC
+} Consistency;
+
+const char *consistency_names[] = { "bsp", "sc" };
+
+typedef struct {
+    NeanderVM vm;                       // Registers, and this core's view of memory
+    long steps;
+    int halted;
+    int ran;                            // Ran a quantum this round (bsp)
+} Core;
+
+typedef struct {
+    unsigned char memory[MEMORY_SIZE];  // Shared memory
+    unsigned char start[MEMORY_SIZE];   // Shared memory as of the last barrier
+    Core cores[MAX_CORES];
+    int core_count;
+    Consistency consistency;
+    long quantum;
+    long max_steps;                     // Per core, 0 for no limit
+    long rounds;
+    int done;
+    pthread_barrier_t barrier;
+} MultiCore;
+
+typedef struct {
+    MultiCore *mc;
+    int id;
+} CoreThread;
+
+int core_active(const MultiCore *mc, const Core *core) {
+    return !core->halted && (mc->max_steps == 0 || core->steps < mc->max_steps);
+}
+
+void core_run_quantum(MultiCore *mc, Core *core) {
+    long budget = mc->quantum;
+    
+    if (mc->max_steps > 0 && mc->max_steps - core->steps < budget) {
+        budget = mc->max_steps - core->steps;
+    }
+    core->steps += run_switch(&core->vm, NULL, budget, &core->halted);
+}
+
+// Run by core 0 alone between barriers: publish the round's stores and
+// decide whether another round is needed
+void multicore_end_round(MultiCore *mc) {
+    if (mc->consistency == CONSISTENCY_BSP) {
+        for (int c = 0; c < mc->core_count; c++) {
+            // A finished core's view is left over from an earlier round
+            if (!mc->cores[c].ran) {
+                continue;
+            }
+            const unsigned char *view = mc->cores[c].vm.memory;
+            for (int a = 0; a < MEMORY_SIZE; a++) {
+                if (view[a] != mc->start[a]) {
+                    mc->memory[a] = view[a];
+                }
+            }
+        }
+    }
+    memcpy(mc->start, mc->memory, MEMORY_SIZE);
+    mc->rounds++;
+    mc->done = 1;
+    for (int c = 0; c < mc->core_count; c++) {
+        if (core_active(mc, &mc->cores[c])) {
+            mc->done = 0;
+        }
+    }
+}
+
+void *core_thread(void *arg) {
+    CoreThread *t = arg;
+    MultiCore *mc = t->mc;
+    Core *core = &mc->cores[t->id];
+    
+    for (;;) {
+        // Round begins; 'start' and 'done' are settled
+        pthread_barrier_wait(&mc->barrier);
+        if (mc->done) {
+            break;
+        }
+        if (mc->consistency == CONSISTENCY_BSP) {
+            core->ran = core_active(mc, core);
+            if (core->ran) {
+                memcpy(core->vm.memory, mc->start, MEMORY_SIZE);
+                core_run_quantum(mc, core);
+            }
+        } else {
+            for (int turn = 0; turn < mc->core_count; turn++) {
+                if (turn == t->id && core_active(mc, core)) {
+                    memcpy(core->vm.memory, mc->memory, MEMORY_SIZE);
+                    core_run_quantum(mc, core);
+                    memcpy(mc->memory, core->vm.memory, MEMORY_SIZE);
+                }
+                pthread_barrier_wait(&mc->barrier);
+            }
+        }
+        pthread_barrier_wait(&mc->barrier);
+        if (t->id == 0) {
+            multicore_end_round(mc);
+        }
+    }
+    return NULL;
+}
+
+// Run 'core_count' cores over one shared copy of 'image'. Core c starts at
+// entries[c] when given, otherwise at the image's PC.
+int run_multicore(const NeanderVM *image, int core_count, const unsigned char *entries,
+                  int entry_count, Consistency consistency, long quantum, long max_steps) {
+    if (core_count < 1 || core_count > MAX_CORES) {
+        fprintf(stderr, "Error: --cores must be between 1 and %d\n", MAX_CORES);
+        return 1;
+    }
+    MultiCore *mc = calloc(1, sizeof(MultiCore));
+    CoreThread threads[MAX_CORES];
+    pthread_t handles[MAX_CORES];
+    if (!mc) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return 1;
+    }
+    memcpy(mc->memory, image->memory, MEMORY_SIZE);
+    memcpy(mc->start, image->memory, MEMORY_SIZE);
+    mc->core_count = core_count;
+    mc->consistency = consistency;
+    mc->quantum = quantum > 0 ? quantum : DEFAULT_QUANTUM;
+    mc->max_steps = max_steps;
+    mc->done = 1;
+    for (int c = 0; c < core_count; c++) {
+        mc->cores[c].vm = *image;
+        mc->cores[c].vm.accumulator = c;
+        if (c < entry_count) {
+            mc->cores[c].vm.PC = entries[c];
+        }
+        if (core_active(mc, &mc->cores[c])) {
+            mc->done = 0;
+        }
+    }
+    
+    printf("Multiprocessor: %d cores, %s consistency, quantum %ld steps\n",
+           core_count, consistency_names[consistency], mc->quantum);
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    pthread_barrier_init(&mc->barrier, NULL, core_count);
+    for (int c = 0; c < core_count; c++) {
+        threads[c].mc = mc;
+        threads[c].id = c;
+        if (pthread_create(&handles[c], NULL, core_thread, &threads[c]) != 0) {
+            fprintf(stderr, "Error: Cannot start core thread\n");
+            exit(1);
+        }
+    }
+    for (int c = 0; c < core_count; c++) {
+        pthread_join(handles[c], NULL);
+    }
+    pthread_barrier_destroy(&mc->barrier);
+    double secs = elapsed_seconds(&begin);
+    
+    long total = 0;
+    for (int c = 0; c < core_count; c++) {
+        total += mc->cores[c].steps;
+    }
+    printf("Finished after %ld rounds, %ld steps in %.3f s (%.2f Msteps/s)\n",
+           mc->rounds, total, secs, secs > 0 ? total / secs / 1e6 : 0);
+    for (int c = 0; c < core_count; c++) {
+        Core *core = &mc->cores[c];
+        printf("Core %d: %s after %ld steps  ", c, core->halted ? "halted" : "step limit", core->steps);
+        print_state(&core->vm);
+    }
+    
+    NeanderVM shared;
+    memcpy(shared.memory, mc->memory, MEMORY_SIZE);
+    printf("\nShared data values:\n");
+    dump_memory(&shared, 0x80, 0x8F);
+    free(mc);
+    return 0;
+}
+
+#define LOCKSTEP_LANES 32
+#define MAX_LANE_LINE 4096
+
+// One byte per lane: with AVX2 a whole LaneVec fits in one register
+typedef unsigned char LaneVec __attribute__((vector_size(LOCKSTEP_LANES)));
+typedef signed char LaneMask __attribute__((vector_size(LOCKSTEP_LANES)));
+typedef unsigned int LaneCount __attribute__((vector_size(LOCKSTEP_LANES * 4)));
+typedef int LaneCountMask __attribute__((vector_size(LOCKSTEP_LANES * 4)));
+
+#define LANE_SELECT(m, a, b) (((a) & (m)) | ((b) & ~(m)))
+
+// LOCKSTEP_LANES VMs in structure-of-arrays form. Lane masks are 0xFF for
+// lanes taking part in an operation and 0x00 otherwise.
+typedef struct {
+    LaneVec memory[MEMORY_SIZE];  // memory[address][lane]
+    LaneVec ac;
+    LaneVec pc;
+    LaneVec n;
+    LaneVec z;
+    LaneVec active;               // Still running
+    LaneVec halted;               // Stopped at HLT
+    unsigned int steps[LOCKSTEP_LANES];
+} LaneGroup;
+
+void lane_group_store(LaneGroup *g, int lane, const NeanderVM *vm) {
+    for (int a = 0; a < MEMORY_SIZE; a++) {
+        g->memory[a][lane] = vm->memory[a];
+    }
+    g->ac[lane] = vm->accumulator;
+    g->pc[lane] = vm->PC;
+    g->n[lane] = vm->N;
+    g->z[lane] = vm->Z;
+    g->active[lane] = 0xFF;
+}
+
+void lane_group_load(const LaneGroup *g, int lane, NeanderVM *vm) {
+    for (int a = 0; a < MEMORY_SIZE; a++) {
+        vm->memory[a] = g->memory[a][lane];
+    }
+    vm->accumulator = g->ac[lane];
+    vm->PC = g->pc[lane];
+    vm->N = g->n[lane];
+    vm->Z = g->z[lane];
+}
+
+static inline int lanes_any(LaneVec v) {
+    unsigned long long words[LOCKSTEP_LANES / 8];
+    unsigned long long any = 0;
+    
+    memcpy(words, &v, sizeof(words));
+    for (int i = 0; i < LOCKSTEP_LANES / 8; i++) {
+        any |= words[i];
+    }
+    return any != 0;
+}
+
+// Index of the first lane set in a non-empty mask
+static inline int lanes_first(LaneVec v) {
+    unsigned long long words[LOCKSTEP_LANES / 8];
+    
+    memcpy(words, &v, sizeof(words));
+    for (int i = 0; i < LOCKSTEP_LANES / 8; i++) {
+        if (words[i]) {
+            return i * 8 + __builtin_ctzll(words[i]) / 8;
+        }
+    }
+    return 0;
+}
+
+#define LANE_ROT(k) { \
+    (0+k)&31,  (1+k)&31,  (2+k)&31,  (3+k)&31,  (4+k)&31,  (5+k)&31,  (6+k)&31,  (7+k)&31, \
+    (8+k)&31,  (9+k)&31,  (10+k)&31, (11+k)&31, (12+k)&31, (13+k)&31, (14+k)&31, (15+k)&31, \
+    (16+k)&31, (17+k)&31, (18+k)&31, (19+k)&31, (20+k)&31, (21+k)&31, (22+k)&31, (23+k)&31, \
+    (24+k)&31, (25+k)&31, (26+k)&31, (27+k)&31, (28+k)&31, (29+k)&31, (30+k)&31, (31+k)&31 }
+
+// Bookkeeping for the lanes of a group that are not being stepped. A lane
+// has run 'iterations - idle' steps; time spent parked is added to idle
+// when it rejoins, so nothing is counted per step.
+typedef struct {
+    long iterations;
+    unsigned int idle[LOCKSTEP_LANES];
+    long parked_at[LOCKSTEP_LANES];
+} LaneClock;
+
+static inline void lanes_park(LaneClock *clock, const LaneVec *lanes) {
+    for (int l = 0; l < LOCKSTEP_LANES; l++) {
+        if ((*lanes)[l]) {
+            clock->parked_at[l] = clock->iterations;
+        }
+    }
+}
+
+static inline void lanes_unpark(LaneClock *clock, const LaneVec *lanes) {
+    for (int l = 0; l < LOCKSTEP_LANES; l++) {
+        if ((*lanes)[l]) {
+            clock->idle[l] += clock->iterations - clock->parked_at[l];
+        }
+    }
+}
+
+// Take lanes out of the group, recording their final step counts
+static inline void lanes_retire(LaneGroup *g, LaneClock *clock, const LaneVec *lanes) {
+    g->active &= ~*lanes;
+    for (int l = 0; l < LOCKSTEP_LANES; l++) {
+        if ((*lanes)[l]) {
+            g->steps[l] = clock->iterations - clock->idle[l];
+        }
+    }
+}
+
+// Pick the lanes to step next: those at the lowest PC among the active
+// lanes. Running the laggards first lets lanes split at JN/JZ meet again.
+static inline LaneVec lanes_schedule(const LaneGroup *g, unsigned char *pc0) {
+    int min_pc = MEMORY_SIZE;
+    
+    for (int l = 0; l < LOCKSTEP_LANES; l++) {
+        if (g->active[l] && g->pc[l] < min_pc) {
+            min_pc = g->pc[l];
+        }
+    }
+    *pc0 = min_pc;
+    return g->active & (LaneVec)(g->pc == *pc0);
+}
+
+// Step every lane of a group until all have halted or used max_steps.
+// Each step executes one instruction for the running lanes, which share
+// one PC (pc0) and the same instruction bytes there; the other active
+// lanes are parked until the running lanes reach their PC. Choosing a new
+// running set (a split at JN/JZ, HLT, differing code) is the only scalar work.
+__attribute__((target_clones("avx2", "default")))
+void lockstep_run(LaneGroup *g, long max_steps) {
+    LaneClock clock;
+    unsigned char pc0;
+    unsigned char varies[MEMORY_SIZE];  // Lanes may hold different bytes here
+    
+    memset(&clock, 0, sizeof(clock));
+    int first = lanes_first(g->active);
+    for (int a = 0; a < MEMORY_SIZE; a++) {
+        LaneVec differs = g->active & (g->memory[a] ^ g->memory[a][first]);
+        varies[a] = lanes_any(differs);
+    }
+    LaneVec sel = lanes_schedule(g, &pc0);
+    LaneVec waiting = g->active & ~sel;
+    lanes_park(&clock, &waiting);
+    
+    while (lanes_any(g->active)) {
+        if (!lanes_any(sel)) {
+            sel = lanes_schedule(g, &pc0);
+            lanes_unpark(&clock, &sel);
+        }
+        
+        // Parked lanes waiting at pc0 join the running set
+        LaneVec parked = g->active & ~sel;
+        if (lanes_any(parked)) {
+            LaneVec join = parked & (LaneVec)(g->pc == pc0);
+            if (lanes_any(join)) {
+                lanes_unpark(&clock, &join);
+                sel |= join;
+            }
+        }
+        
+        // Where the code may differ between lanes (patched or self-modified)
+        // only the lanes agreeing with the first one are stepped
+        unsigned char arg_addr = pc0 + 1;
+        int lead = 0;
+        if (varies[pc0] || varies[arg_addr]) {
+            lead = lanes_first(sel);
+        }
+        unsigned char op = g->memory[pc0][lead] & 0xF0;
+        unsigned char arg = g->memory[arg_addr][lead];
+        if (varies[pc0] || varies[arg_addr]) {
+            LaneVec same = (LaneVec)((g->memory[pc0] & 0xF0) == op);
+            if (op == OP_STA || op == OP_LDA || op == OP_ADD || op == OP_OR ||
+                op == OP_AND || op == OP_JMP || op == OP_JN || op == OP_JZ) {
+                same &= (LaneVec)(g->memory[arg_addr] == arg);
+            }
+            LaneVec other = sel & ~same;
+            if (lanes_any(other)) {
+                lanes_park(&clock, &other);
+                sel &= same;
+            }
+        }
+        clock.iterations++;
+        
+        LaneVec taken;
+        switch (op) {
+            case OP_STA:
+                g->memory[arg] = LANE_SELECT(sel, g->ac, g->memory[arg]);
+                varies[arg] = 1;
+                g->pc += sel & 2;
+                pc0 += 2;
+                break;
+            case OP_LDA:
+            case OP_ADD:
+            case OP_OR:
+            case OP_AND:
+            case OP_NOT: {
+                LaneVec value = g->memory[arg];
+                LaneVec result;
+                if (op == OP_LDA) {
+                    result = value;
+                } else if (op == OP_ADD) {
+                    result = g->ac + value;
+                } else if (op == OP_OR) {
+                    result = g->ac | value;
+                } else if (op == OP_AND) {
+                    result = g->ac & value;
+                } else {
+                    result = ~g->ac;
+                }
+                g->ac = LANE_SELECT(sel, result, g->ac);
+                g->n = LANE_SELECT(sel, result >> 7, g->n);
+                g->z = LANE_SELECT(sel, (LaneVec)(result == 0) & 1, g->z);
+                g->pc += sel & (unsigned char)(op == OP_NOT ? 1 : 2);
+                pc0 += op == OP_NOT ? 1 : 2;
+                break;
+            }
+            case OP_JMP:
+                g->pc = LANE_SELECT(sel, (LaneVec){0} + arg, g->pc);
+                pc0 = arg;
+                break;
+            case OP_JN:
+            case OP_JZ:
+                taken = sel & (LaneVec)((op == OP_JN ? g->n : g->z) != 0);
+                g->pc = LANE_SELECT(taken, (LaneVec){0} + arg, LANE_SELECT(sel, g->pc + 2, g->pc));
+                if (!lanes_any(taken)) {
+                    pc0 += 2;
+                } else if (!lanes_any(sel & ~taken)) {
+                    pc0 = arg;
+                } else {
+                    // The lanes split here: park everyone and reschedule
+                    lanes_park(&clock, &sel);
+                    sel = (LaneVec){0};
+                }
+                break;
+            case OP_HLT:
+                g->halted |= sel;
+                lanes_retire(g, &clock, &sel);
+                sel = (LaneVec){0};
+                break;
+            default:
+                g->pc += sel & 1;
+                pc0++;
+                break;
+        }
+        
+        // No lane can be over budget before the group has done max_steps
+        // iterations; parked lanes are not charged, so check running ones
+        if (max_steps > 0 && clock.iterations >= max_steps && lanes_any(sel)) {
+            LaneVec spent = (LaneVec){0};
+            for (int l = 0; l < LOCKSTEP_LANES; l++) {
+                if (sel[l] && clock.iterations - clock.idle[l] >= max_steps) {
+                    spent[l] = 0xFF;
+                }
+            }
+            if (lanes_any(spent)) {
+                lanes_retire(g, &clock, &spent);
+                sel &= ~spent;
+            }
+        }
+    }
+}
+
+// Parse one line of the lanes file: "addr value" hex pairs, as in .DATA
+int parse_lane_line(char *line, NeanderVM *vm) {
+    char *comment = strchr(line, ';');
+    int pairs = 0;
+    
+    if (comment) {
+        *comment = '\0';
+    }
+    char *addr_str = strtok(line, " \t\r\n");
+    while (addr_str) {
+        char *value_str = strtok(NULL, " \t\r\n");
+        if (!value_str) {
+            return -1;
+        }
+        long addr = strtol(addr_str, NULL, 16);
+        long value = strtol(value_str, NULL, 16);
+        if (addr < 0 || addr >= MEMORY_SIZE) {
+            return -1;
+        }
+        vm->memory[addr] = (unsigned char)value;
+        pairs++;
+        addr_str = strtok(NULL, " \t\r\n");
+    }
+    return pairs;
+}
+
+// Run the loaded program once per line of lanes_file, each line patching
+// the image with its own data values, LOCKSTEP_LANES lanes at a time.
+// With 'check' the lanes are also run one by one on the threaded engine
+// and compared.
+int run_lockstep(const NeanderVM *image, const char *lanes_file, long max_steps, int check) {
+    FILE *file = fopen(lanes_file, "r");
+    if (!file) {
+        fprintf(stderr, "Error: Cannot open lanes file %s\n", lanes_file);
+        return 1;
+    }
+    
+    NeanderVM *lanes = NULL;
+    int lane_count = 0;
+    int capacity = 0;
+    char line[MAX_LANE_LINE];
+    int line_number = 0;
+    
+    while (fgets(line, sizeof(line), file)) {
+        line_number++;
+        if (lane_count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            lanes = realloc(lanes, capacity * sizeof(NeanderVM));
+            if (!lanes) {
+                fprintf(stderr, "Error: Out of memory\n");
+                exit(1);
+            }
+        }
+        lanes[lane_count] = *image;
+        int pairs = parse_lane_line(line, &lanes[lane_count]);
+        if (pairs < 0) {
+            fprintf(stderr, "Error: Invalid lane data at line %d\n", line_number);
+            fclose(file);
+            free(lanes);
+            return 1;
+        }
+        if (pairs > 0) {
+            lane_count++;
+        }
+    }
+    fclose(file);
+    
+    if (lane_count == 0) {
+        fprintf(stderr, "Error: No lanes in %s\n", lanes_file);
+        free(lanes);
+        return 1;
+    }
+    
+    int group_count = (lane_count + LOCKSTEP_LANES - 1) / LOCKSTEP_LANES;
+    LaneGroup *groups = aligned_alloc(sizeof(LaneCount), group_count * sizeof(LaneGroup));
+    if (!groups) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(1);
+    }
+    memset(groups, 0, group_count * sizeof(LaneGroup));
+    for (int i = 0; i < lane_count; i++) {
+        lane_group_store(&groups[i / LOCKSTEP_LANES], i % LOCKSTEP_LANES, &lanes[i]);
+    }
+    
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int g = 0; g < group_count; g++) {
+        lockstep_run(&groups[g], max_steps);
+    }
+    double lockstep_secs = elapsed_seconds(&start);
+    
+    int status = 0;
+    for (int i = 0; i < lane_count; i++) {
+        LaneGroup *g = &groups[i / LOCKSTEP_LANES];
+        int l = i % LOCKSTEP_LANES;
+        NeanderVM vm;
+        lane_group_load(g, l, &vm);
+        printf("Lane %d: AC: %02X  PC: %02X  N: %d  Z: %d  steps: %u  %s  data:",
+               i, vm.accumulator, vm.PC, vm.N, vm.Z, g->steps[l],
+               g->halted[l] ? "halted" : "step limit");
+        for (int a = 0x80; a <= 0x8F; a++) {
+            printf(" %02X", vm.memory[a]);
+        }
+        printf("\n");
+    }
+    
+    if (check) {
+        DecodeCache cache;
+        int halted;
+        
+        init_cache(&cache);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < lane_count; i++) {
+            long steps = run_threaded(&lanes[i], &cache, max_steps, &halted);
+            cache.ready = 0;
+            
+            LaneGroup *g = &groups[i / LOCKSTEP_LANES];
+            int l = i % LOCKSTEP_LANES;
+            NeanderVM vm;
+            lane_group_load(g, l, &vm);
+            if (steps != (long)g->steps[l] || halted != (g->halted[l] != 0) || !same_state(&vm, &lanes[i])) {
+                fprintf(stderr, "Error: lane %d diverged from the threaded engine\n", i);
+                status = 1;
+            }
+        }
+        double scalar_secs = elapsed_seconds(&start);
+        printf("Lockstep: %d lanes in %.6f s, threaded one by one: %.6f s (%.2fx)\n",
+               lane_count, lockstep_secs, scalar_secs,
+               lockstep_secs > 0 ? scalar_secs / lockstep_secs : 0);
+    }
+    
+    free(groups);
+    free(lanes);
+    return status;
+}
+
+// On-disk result cache. Runs are deterministic, so the final state is a
+// function of the initial image and the step budget. The cache file is an
+// mmap'd open-addressing table keyed by a hash of both; each key may live
+// in any of RESULT_CACHE_PROBE slots from its home slot, and when all of
+// them are taken the least recently used one is replaced. Every access
+// holds an flock on the file, so concurrent executors can share it.
+#define RESULT_CACHE_MAGIC "NRCACHE1"
+#define RESULT_CACHE_SLOTS 4096
+#define RESULT_CACHE_PROBE 16
+
+typedef struct {
+    char magic[8];
+    unsigned long long slot_count;
+    unsigned long long clock;   // Bumped on every access, for LRU
+    unsigned char reserved[40];
+} ResultCacheHeader;
+
+typedef struct {
+    unsigned long long hash;    // 0 marks an empty slot
+    unsigned long long last_used;
+    long long max_steps;
+    long long steps;
+    unsigned char image[MEMORY_SIZE];
+    unsigned char memory[MEMORY_SIZE];
+    unsigned char accumulator, PC, N, Z;
+    unsigned char halted;
+    unsigned char reserved[3];
+} ResultCacheSlot;
+
+typedef struct {
+    int fd;
+    ResultCacheHeader *header;
+    ResultCacheSlot *slots;
+    size_t size;
+    pthread_mutex_t lock;       // flock is per process, so threads need this too
+    long hits;
+    long misses;
+} ResultCache;
+
+// FNV-1a over the image and the step budget; never 0
+unsigned long long result_cache_hash(const NeanderVM *vm, long max_steps) {
+    unsigned long long hash = 0xCBF29CE484222325ULL;
+    
+    for (int i = 0; i < MEMORY_SIZE; i++) {
+        hash = (hash ^ vm->memory[i]) * 0x100000001B3ULL;
+    }
+    for (int i = 0; i < 8; i++) {
+        hash = (hash ^ ((unsigned long long)max_steps >> (8 * i) & 0xFF)) * 0x100000001B3ULL;
+    }
+    return hash ? hash : 1;
+}
+
+// Open or create a cache file. Returns NULL (after printing why) if it
+// cannot be used.
+ResultCache *result_cache_open(const char *path) {
+    size_t size = sizeof(ResultCacheHeader) + RESULT_CACHE_SLOTS * sizeof(ResultCacheSlot);
+    struct stat st;
+    
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open cache file %s\n", path);
+        return NULL;
+    }
+    flock(fd, LOCK_EX);
+    if (fstat(fd, &st) < 0 || (st.st_size == 0 && ftruncate(fd, size) < 0)) {
+        fprintf(stderr, "Error: Cannot create cache file %s\n", path);
+        flock(fd, LOCK_UN);
+        close(fd);
+        return NULL;
+    }
+    if (st.st_size != 0 && (size_t)st.st_size != size) {
+        fprintf(stderr, "Error: %s is not a result cache\n", path);
+        flock(fd, LOCK_UN);
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: Cannot map cache file %s\n", path);
+        flock(fd, LOCK_UN);
+        close(fd);
+        return NULL;
+    }
+    
+    ResultCacheHeader *header = map;
+    if (st.st_size == 0) {
+        memcpy(header->magic, RESULT_CACHE_MAGIC, sizeof(header->magic));
+        header->slot_count = RESULT_CACHE_SLOTS;
+        header->clock = 0;
+    } else if (memcmp(header->magic, RESULT_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+               header->slot_count != RESULT_CACHE_SLOTS) {
+        fprintf(stderr, "Error: %s is not a result cache\n", path);
+        munmap(map, size);
+        flock(fd, LOCK_UN);
+        close(fd);
+        return NULL;
+    }
+    flock(fd, LOCK_UN);
+    
+    ResultCache *cache = calloc(1, sizeof(ResultCache));
+    if (!cache) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(1);
+    }
+    cache->fd = fd;
+    cache->header = header;
+    cache->slots = (ResultCacheSlot *)(header + 1);
+    cache->size = size;
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+void result_cache_close(ResultCache *cache) {
+    munmap(cache->header, cache->size);
+    close(cache->fd);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+void result_cache_lock(ResultCache *cache) {
+    pthread_mutex_lock(&cache->lock);
+    flock(cache->fd, LOCK_EX);
+}
+
+void result_cache_unlock(ResultCache *cache) {
+    flock(cache->fd, LOCK_UN);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Look up the run of *vm's image under max_steps. On a hit, *vm becomes
+// the final state and 1 is returned with *steps and *halted filled in.
+int result_cache_lookup(ResultCache *cache, NeanderVM *vm, long max_steps,
+                        long *steps, int *halted) {
+    unsigned long long hash = result_cache_hash(vm, max_steps);
+    int found = 0;
+    
+    result_cache_lock(cache);
+    for (int i = 0; i < RESULT_CACHE_PROBE; i++) {
+        ResultCacheSlot *slot = &cache->slots[(hash + i) % RESULT_CACHE_SLOTS];
+        if (slot->hash == 0) {
+            break;
+        }
+        if (slot->hash == hash && slot->max_steps == max_steps &&
+            memcmp(slot->image, vm->memory, MEMORY_SIZE) == 0) {
+            slot->last_used = ++cache->header->clock;
+            memcpy(vm->memory, slot->memory, MEMORY_SIZE);
+            vm->accumulator = slot->accumulator;
+            vm->PC = slot->PC;
+            vm->N = slot->N;
+            vm->Z = slot->Z;
+            *steps = slot->steps;
+            *halted = slot->halted;
+            found = 1;
+            break;
+        }
+    }
+    result_cache_unlock(cache);
+    
+    __atomic_add_fetch(found ? &cache->hits : &cache->misses, 1, __ATOMIC_RELAXED);
+    return found;
+}
+
+// Record the final state 'vm' reached from 'image' under max_steps
+void result_cache_store(ResultCache *cache, const unsigned char *image, long max_steps,
+                        const NeanderVM *vm, long steps, int halted) {
+    NeanderVM key;
+    memcpy(key.memory, image, MEMORY_SIZE);
+    unsigned long long hash = result_cache_hash(&key, max_steps);
+    
+    result_cache_lock(cache);
+    ResultCacheSlot *victim = NULL;
+    for (int i = 0; i < RESULT_CACHE_PROBE; i++) {
+        ResultCacheSlot *slot = &cache->slots[(hash + i) % RESULT_CACHE_SLOTS];
+        if (slot->hash == 0 || (slot->hash == hash && slot->max_steps == max_steps &&
+                                memcmp(slot->image, image, MEMORY_SIZE) == 0)) {
+            victim = slot;
+            break;
+        }
+        if (!victim || slot->last_used < victim->last_used) {
+            victim = slot;
+        }
+    }
+    victim->hash = hash;
+    victim->last_used = ++cache->header->clock;
+    victim->max_steps = max_steps;
+    victim->steps = steps;
+    memcpy(victim->image, image, MEMORY_SIZE);
+    memcpy(victim->memory, vm->memory, MEMORY_SIZE);
+    victim->accumulator = vm->accumulator;
+    victim->PC = vm->PC;
+    victim->N = vm->N;
+    victim->Z = vm->Z;
+    victim->halted = halted;
+    result_cache_unlock(cache);
+}
+
+// Single run through the result cache: replay a stored result or run the
+// program under 'engine' and store what it produced
+int run_cached(NeanderVM *vm, EngineFn engine, int max_steps, const char *path) {
+    ResultCache *cache = result_cache_open(path);
+    unsigned char image[MEMORY_SIZE];
+    DecodeCache decode;
+    long steps;
+    int halted;
+    
+    if (!cache) {
+        return 1;
+    }
+    printf("Starting execution...\n");
+    int hit = result_cache_lookup(cache, vm, max_steps, &steps, &halted);
+    if (!hit) {
+        memcpy(image, vm->memory, MEMORY_SIZE);
+        init_cache(&decode);
+        steps = engine(vm, &decode, max_steps, &halted);
+        result_cache_store(cache, image, max_steps, vm, steps, halted);
+    }
+    print_summary(vm, steps);
+    printf("\nResult cache: %s %s\n", hit ? "hit in" : "miss, stored in", path);
+    result_cache_close(cache);
+    return 0;
+}
+
+#define BATCH_QUANTUM 65536     // Steps a worker runs before requeueing a job
+#define MAX_PATH_LENGTH 4096
+
+typedef enum {
+    JOB_PENDING,
+    JOB_RUNNING,
+    JOB_HALTED,
+    JOB_STEP_LIMIT,
+    JOB_LOAD_ERROR,
+    JOB_LOOP
+} JobStatus;
+
+typedef struct {
+    char *path;
+    NeanderVM vm;
+    long steps;
+    JobStatus status;
+    LoopDetector *detector;     // Only with --detect-loops
+    Profile *profile;           // Only with --profile
+    char *trace_path;           // Only with --trace
+    unsigned char *image;       // Initial image, kept for --cache
+    TraceWriter *trace;
+    DecodeCache *cache;         // Own decode cache once the job outlives its first quantum
+} BatchJob;
+
+// Work queue of job indices owned by one worker. The owner takes jobs from
+// the front and puts unfinished ones back at the end, so every job gets a
+// quantum in turn; idle workers steal from the end.
+typedef struct {
+    pthread_mutex_t lock;
+    int *items;
+    int capacity;
+    int head;
+    int count;
+} JobDeque;
+
+typedef struct {
+    BatchJob *jobs;
+    int job_count;
+    JobDeque *deques;
+    int worker_count;
+    long max_steps;
+    int detect_loops;
+    int profile;
+    const char *trace_dir;
+    TraceFlusher *flusher;
+    ResultCache *cache;         // Only with --cache
+    int remaining;              // Jobs not finished yet, updated atomically
+} BatchRun;
+
+typedef struct {
+    BatchRun *run;
+    int id;
+    long steals;
+    long iterations_skipped;
+} BatchWorker;
+
+void deque_init(JobDeque *q, int capacity) {
+    pthread_mutex_init(&q->lock, NULL);
+    q->items = malloc(capacity * sizeof(int));
+    if (!q->items) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(1);
+    }
+    q->capacity = capacity;
+    q->head = 0;
+    q->count = 0;
+}
+
+void deque_push_back(JobDeque *q, int job) {
+    pthread_mutex_lock(&q->lock);
+    q->items[(q->head + q->count) % q->capacity] = job;
+    q->count++;
+    pthread_mutex_unlock(&q->lock);
+}
+
+int deque_pop_front(JobDeque *q) {
+    int job = -1;
+    
+    pthread_mutex_lock(&q->lock);
+    if (q->count > 0) {
+        job = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return job;
+}
+
+int deque_pop_back(JobDeque *q) {
+    int job = -1;
+    
+    pthread_mutex_lock(&q->lock);
+    if (q->count > 0) {
+        q->count--;
+        job = q->items[(q->head + q->count) % q->capacity];
+    }
+    pthread_mutex_unlock(&q->lock);
+    return job;
+}
+
+// Take the next job: our own queue first, then steal from the others
+int batch_next_job(BatchWorker *worker) {
+    BatchRun *run = worker->run;
+    int job = deque_pop_front(&run->deques[worker->id]);
+    
+    for (int i = 1; job < 0 && i < run->worker_count; i++) {
+        job = deque_pop_back(&run->deques[(worker->id + i) % run->worker_count]);
+        if (job >= 0) {
+            worker->steals++;
+        }
+    }
+    return job;
+}
+
+// Traces go to <dir>/<job number>-<image name>.trace
+void trace_job_open(BatchRun *run, BatchJob *job) {
+    const char *slash = strrchr(job->path, '/');
+    const char *name = slash ? slash + 1 : job->path;
+    size_t size = strlen(run->trace_dir) + strlen(name) + 32;
+    
+    job->trace_path = malloc(size);
+    if (!job->trace_path) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(1);
+    }
+    snprintf(job->trace_path, size, "%s/%d-%s.trace", run->trace_dir, (int)(job - run->jobs), name);
+    job->trace = trace_open(run->flusher, job->trace_path, &job->vm);
+    if (!job->trace) {
+        fprintf(stderr, "Error: Cannot open trace file %s\n", job->trace_path);
+        free(job->trace_path);
+        job->trace_path = NULL;
+    }
+}
+
+// Run one quantum of a job; returns 1 when the job is finished
+int batch_step_job(BatchRun *run, BatchJob *job, DecodeCache *cache) {
+    int halted;
+    
+    if (job->status == JOB_PENDING) {
+        init_vm(&job->vm);
+        if (read_image(&job->vm, job->path) < 0) {
+            job->status = JOB_LOAD_ERROR;
+            return 1;
+        }
+        job->status = JOB_RUNNING;
+        cache->ready = 0;
+        if (run->cache) {
+            int hit_halted;
+            if (result_cache_lookup(run->cache, &job->vm, run->max_steps, &job->steps, &hit_halted)) {
+                job->status = hit_halted ? JOB_HALTED : JOB_STEP_LIMIT;
+                return 1;
+            }
+            job->image = malloc(MEMORY_SIZE);
+            if (!job->image) {
+                fprintf(stderr, "Error: Out of memory\n");
+                exit(1);
+            }
+            memcpy(job->image, job->vm.memory, MEMORY_SIZE);
+        }
+        if (run->detect_loops) {
+            job->detector = malloc(sizeof(LoopDetector));
+            if (!job->detector) {
+                fprintf(stderr, "Error: Out of memory\n");
+                exit(1);
+            }
+            loop_detector_init(job->detector, &job->vm);
+        }
+        if (run->trace_dir) {
+            trace_job_open(run, job);
+        }
+        if (run->profile) {
+            job->profile = calloc(1, sizeof(Profile));
+            if (!job->profile) {
+                fprintf(stderr, "Error: Out of memory\n");
+                exit(1);
+            }
+        }
+    }
+    
+    long slice = BATCH_QUANTUM;
+    if (run->max_steps > 0 && run->max_steps - job->steps < slice) {
+        slice = run->max_steps - job->steps;
+    }
+    if (job->detector) {
+        job->steps += loop_detector_run(job->detector, &job->vm, slice, &halted);
+        if (job->detector->period) {
+            job->status = JOB_LOOP;
+            return 1;
+        }
+    } else {
+        // A job's first quantum runs on the worker's cache; after that it
+        // keeps its own, still ready, wherever it runs next
+        DecodeCache *active = job->cache ? job->cache : cache;
+        active->profile = job->profile;
+        active->trace = job->trace;
+        long steps = run_threaded(&job->vm, active, slice, &halted);
+        job->steps += steps;
+        if (job->trace) {
+            job->trace->steps += steps;
+            trace_pause(job->trace);
+        }
+    }
+    
+    if (halted) {
+        job->status = JOB_HALTED;
+    } else if (run->max_steps > 0 && job->steps >= run->max_steps) {
+        job->status = JOB_STEP_LIMIT;
+    } else {
+        if (!job->cache && !job->detector) {
+            job->cache = malloc(sizeof(DecodeCache));
+            if (!job->cache) {
+                fprintf(stderr, "Error: Out of memory\n");
+                exit(1);
+            }
+            *job->cache = *cache;
+            job->cache->iterations_skipped = 0;
+        }
+        return 0;
+    }
+    if (job->cache) {
+        cache->iterations_skipped += job->cache->iterations_skipped;
+        free(job->cache);
+        job->cache = NULL;
+    }
+    if (job->trace) {
+        trace_close(job->trace);
+    }
+    if (job->image) {
+        result_cache_store(run->cache, job->image, run->max_steps, &job->vm, job->steps, halted);
+    }
+    return 1;
+}
+
+void *batch_worker(void *arg) {
+    BatchWorker *worker = arg;
+    BatchRun *run = worker->run;
+    DecodeCache cache;
+    
+    init_cache(&cache);
+    while (__atomic_load_n(&run->remaining, __ATOMIC_ACQUIRE) > 0) {
+        int index = batch_next_job(worker);
+        if (index < 0) {
+            sched_yield();  // Everything left is being run by someone else
+            continue;
+        }
+        if (batch_step_job(run, &run->jobs[index], &cache)) {
+            __atomic_sub_fetch(&run->remaining, 1, __ATOMIC_RELEASE);
+        } else {
+            deque_push_back(&run->deques[worker->id], index);
+        }
+    }
+    worker->iterations_skipped = cache.iterations_skipped;
+    return NULL;
+}
+
+// Append one path to a growing job list
+void batch_add_job(BatchJob **jobs, int *count, int *capacity, const char *path) {
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 256;
+        *jobs = realloc(*jobs, *capacity * sizeof(BatchJob));
+        if (!*jobs) {
+            fprintf(stderr, "Error: Out of memory\n");
+            exit(1);
+        }
+    }
+    BatchJob *job = &(*jobs)[(*count)++];
+    job->path = strdup(path);
+    job->steps = 0;
+    job->status = JOB_PENDING;
+    job->detector = NULL;
+    job->profile = NULL;
+    job->trace_path = NULL;
+    job->trace = NULL;
+    job->image = NULL;
+    job->cache = NULL;
+}
+
+int compare_jobs(const void *a, const void *b) {
+    return strcmp(((const BatchJob *)a)->path, ((const BatchJob *)b)->path);
+}
+
+// Collect the images to run: every regular file in a directory (sorted by
+// name), or one path per line of a manifest file
+int batch_collect(const char *source, BatchJob **jobs) {
+    struct stat st;
+    int count = 0;
+    int capacity = 0;
+    char path[MAX_PATH_LENGTH];
+    
+    *jobs = NULL;
+    if (stat(source, &st) != 0) {
+        fprintf(stderr, "Error: Cannot open %s\n", source);
+        return -1;
+    }
+    
+    if (S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(source);
+        if (!dir) {
+            fprintf(stderr, "Error: Cannot open directory %s\n", source);
+            return -1;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            snprintf(path, sizeof(path), "%s/%s", source, entry->d_name);
+            if (entry->d_name[0] != '.' && stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+                batch_add_job(jobs, &count, &capacity, path);
+            }
+        }
+        closedir(dir);
+        qsort(*jobs, count, sizeof(BatchJob), compare_jobs);
+    } else {
+        FILE *manifest = fopen(source, "r");
+        if (!manifest) {
+            fprintf(stderr, "Error: Cannot open manifest %s\n", source);
+            return -1;
+        }
+        while (fgets(path, sizeof(path), manifest)) {
+            path[strcspn(path, "\r\n")] = '\0';
+            if (path[0] != '\0' && path[0] != '#') {
+                batch_add_job(jobs, &count, &capacity, path);
+            }
+        }
+        fclose(manifest);
+    }
+    return count;
+}
+
+void fprint_json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(out, "\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(out, "\\u%04x", (unsigned char)*s);
+        } else {
+            fputc(*s, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// One JSON object per line, in job order
+void batch_write_results(FILE *out, const BatchJob *jobs, int count) {
+    static const char *status_names[] = {
+        "pending", "running", "halted", "step_limit", "load_error", "loop"
+    };
+    
+    for (int i = 0; i < count; i++) {
+        const BatchJob *job = &jobs[i];
+        fprintf(out, "{\"file\": ");
+        fprint_json_string(out, job->path);
+        fprintf(out, ", \"status\": \"%s\"", status_names[job->status]);
+        if (job->status != JOB_LOAD_ERROR) {
+            fprintf(out, ", \"steps\": %ld, \"ac\": %d, \"pc\": %d, \"n\": %d, \"z\": %d, \"data\": [",
+                    job->steps, job->vm.accumulator, job->vm.PC, job->vm.N, job->vm.Z);
+            for (int a = 0x80; a <= 0x8F; a++) {
+                fprintf(out, "%s%d", a == 0x80 ? "" : ", ", job->vm.memory[a]);
+            }
+            fprintf(out, "]");
+        }
+        if (job->status == JOB_LOOP) {
+            fprintf(out, ", \"loop_start\": %ld, \"period\": %ld",
+                    job->detector->loop_start, job->detector->period);
+        }
+        if (job->trace_path) {
+            fprintf(out, ", \"trace\": ");
+            fprint_json_string(out, job->trace_path);
+        }
+        fprintf(out, "}\n");
+    }
+}
+
+// Run every image from a directory or manifest on worker_count threads
+int run_batch(const char *source, const char *output, long max_steps, int worker_count,
+              int detect_loops, const char *profile_output, const char *trace_dir,
+              const char *cache_path) {
+    BatchJob *jobs;
+    int count = batch_collect(source, &jobs);
+    if (count < 0) {
+        return 1;
+    }
+    
+    FILE *out = fopen(output, "w");
+    if (!out) {
+        fprintf(stderr, "Error: Cannot open output file %s\n", output);
+        return 1;
+    }
+    
+    if (worker_count < 1) {
+        worker_count = 1;
+    }
+    FILE *profile_out = NULL;
+    if (profile_output) {
+        profile_out = fopen(profile_output, "w");
+        if (!profile_out) {
+            fprintf(stderr, "Error: Cannot open profile file %s\n", profile_output);
+            fclose(out);
+            return 1;
+        }
+    }
+    
+    BatchRun run = { jobs, count, NULL, worker_count, max_steps, detect_loops,
+                     profile_out != NULL, trace_dir, NULL, NULL, count };
+    if (cache_path) {
+        // Loop detection, profiles and traces need the program to run
+        if (detect_loops || profile_out || trace_dir) {
+            fprintf(stderr, "Warning: --cache is ignored with --detect-loops, --profile or --trace\n");
+        } else if (!(run.cache = result_cache_open(cache_path))) {
+            fclose(out);
+            return 1;
+        }
+    }
+    if (trace_dir) {
+        run.flusher = trace_flusher_create(2 * worker_count + 2);
+    }
+    run.deques = malloc(worker_count * sizeof(JobDeque));
+    BatchWorker *workers = malloc(worker_count * sizeof(BatchWorker));
+    pthread_t *threads = malloc(worker_count * sizeof(pthread_t));
+    if (!run.deques || !workers || !threads) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(1);
+    }
+    for (int w = 0; w < worker_count; w++) {
+        deque_init(&run.deques[w], count + 1);
+    }
+    for (int i = 0; i < count; i++) {
+        deque_push_back(&run.deques[i % worker_count], i);
+    }
+    
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int w = 0; w < worker_count; w++) {
+        workers[w].run = &run;
+        workers[w].id = w;
+        workers[w].steals = 0;
+        pthread_create(&threads[w], NULL, batch_worker, &workers[w]);
+    }
+    long steals = 0;
+    long skipped = 0;
+    for (int w = 0; w < worker_count; w++) {
+        pthread_join(threads[w], NULL);
+        steals += workers[w].steals;
+        skipped += workers[w].iterations_skipped;
+    }
+    if (run.flusher && trace_flusher_finish(run.flusher) < 0) {
+        fprintf(stderr, "Error: Cannot write trace files in %s\n", trace_dir);
+    }
+    double secs = elapsed_seconds(&start);
+    
+    batch_write_results(out, jobs, count);
+    fclose(out);
+    if (profile_out) {
+        // One JSON line per image that ran under the profiler
+        for (int i = 0; i < count; i++) {
+            if (jobs[i].profile) {
+                fprintf(profile_out, "{\"file\": ");
+                fprint_json_string(profile_out, jobs[i].path);
+                fprintf(profile_out, ", ");
+                write_profile(profile_out, jobs[i].profile, jobs[i].steps);
+                fprintf(profile_out, "}\n");
+            }
+        }
+        fclose(profile_out);
+    }
+    
+    long total_steps = 0;
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        total_steps += jobs[i].steps;
+        failed += jobs[i].status == JOB_LOAD_ERROR;
+    }
+    printf("Batch: %d images (%d unreadable) on %d threads in %.3f s, %ld steps, %ld steals\n",
+           count, failed, worker_count, secs, total_steps, steals);
+    if (skipped) {
+        printf("Loop idioms: %ld iterations skipped\n", skipped);
+    }
+    if (run.cache) {
+        printf("Result cache: %ld hits, %ld misses\n", run.cache->hits, run.cache->misses);
+        result_cache_close(run.cache);
+    }
+    printf("Results written to %s\n", output);
+    
+    for (int w = 0; w < worker_count; w++) {
+        pthread_mutex_destroy(&run.deques[w].lock);
+        free(run.deques[w].items);
+    }
+    for (int i = 0; i < count; i++) {
+        free(jobs[i].path);
+        free(jobs[i].detector);
+        free(jobs[i].profile);
+        free(jobs[i].trace_path);
+        free(jobs[i].trace);
+        free(jobs[i].image);
+    }
+    free(run.deques);
+    free(workers);
+    free(threads);
+    free(jobs);
+    return failed ? 1 : 0;
+}
+
+// Daemon mode: run jobs sent over a Unix domain socket on a worker pool.
+// All integers are little-endian.
+//   Request:  'J' id(u32) max_steps(u32, 0 = daemon default) outputs(u8)
+//             length(u16, at most 256) image[length]
+//   Response: id(u32) status(u8) steps(u32), then per 'outputs' bit:
+//             DAEMON_OUT_REGS   AC PC N Z
+//             DAEMON_OUT_DATA   memory[0x80..0x8F]
+//             DAEMON_OUT_MEMORY memory[0..255]
+// Responses are streamed as jobs finish, so they may arrive out of order.
+// A client ends its session by shutting down its write side; the daemon
+// answers every pending job and then closes the connection.
+#define DAEMON_REQUEST_HEADER 12
+#define DAEMON_RESPONSE_MAX (9 + 4 + 16 + MEMORY_SIZE)
+#define DAEMON_READ_BUFFER 65536
+#define DAEMON_OUT_REGS   0x01
+#define DAEMON_OUT_DATA   0x02
+#define DAEMON_OUT_MEMORY 0x04
+
+typedef enum {
+    DAEMON_HALTED,
+    DAEMON_STEP_LIMIT
+} DaemonStatus;
+
+typedef struct {
+    int fd;
+    pthread_mutex_t write_lock;
+    int refs;                   // Reader plus unanswered jobs, updated atomically
+} DaemonConnection;
+
+typedef struct DaemonJob {
+    DaemonConnection *conn;
+    unsigned int id;
+    long max_steps;
+    unsigned char outputs;
+    NeanderVM vm;
+    struct DaemonJob *next;
+} DaemonJob;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    DaemonJob *head;
+    DaemonJob *tail;
+    long default_steps;
+} DaemonQueue;
+
+typedef struct {
+    int fd;
+    unsigned char buffer[DAEMON_READ_BUFFER];
+    size_t start;
+    size_t end;
+} SocketReader;
+
+// Copy the next n bytes from the socket. Returns 0 at a clean end of
+// stream before the first byte, -1 on error or a truncated read.
+int socket_read(SocketReader *r, unsigned char *out, size_t n) {
+    size_t done = 0;
+    
+    while (done < n) {
+        if (r->start == r->end) {
+            ssize_t got = read(r->fd, r->buffer, sizeof(r->buffer));
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                return done == 0 && got == 0 ? 0 : -1;
+            }
+            r->start = 0;
+            r->end = got;
+        }
+        size_t chunk = r->end - r->start < n - done ? r->end - r->start : n - done;
+        memcpy(out + done, r->buffer + r->start, chunk);
+        r->start += chunk;
+        done += chunk;
+    }
+    return 1;
+}
+
+int socket_write(int fd, const unsigned char *data, size_t n) {
+    while (n > 0) {
+        ssize_t sent = send(fd, data, n, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return -1;
+        }
+        data += sent;
+        n -= sent;
+    }
+    return 0;
+}
+
+void daemon_release(DaemonConnection *conn) {
+    if (__atomic_sub_fetch(&conn->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(conn->fd);
+        pthread_mutex_destroy(&conn->write_lock);
+        free(conn);
+    }
+}
+
+void daemon_enqueue(DaemonQueue *q, DaemonJob *job) {
+    job->next = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail) {
+        q->tail->next = job;
+    } else {
+        q->head = job;
+    }
+    q->tail = job;
+    pthread_cond_signal(&q->ready);
+    pthread_mutex_unlock(&q->lock);
+}
+
+void *daemon_worker(void *arg) {
+    DaemonQueue *q = arg;
+    DecodeCache cache;
+    unsigned char response[DAEMON_RESPONSE_MAX];
+    
+    init_cache(&cache);
+    for (;;) {
+        pthread_mutex_lock(&q->lock);
+        while (!q->head) {
+            pthread_cond_wait(&q->ready, &q->lock);
+        }
+        DaemonJob *job = q->head;
+        q->head = job->next;
+        if (!q->head) {
+            q->tail = NULL;
+        }
+        pthread_mutex_unlock(&q->lock);
+        
+        int halted;
+        cache.ready = 0;
+        long steps = run_threaded(&job->vm, &cache, job->max_steps, &halted);
+        
+        size_t n = 9;
+        put32(response, job->id);
+        response[4] = halted ? DAEMON_HALTED : DAEMON_STEP_LIMIT;
+        put32(response + 5, (unsigned int)steps);
+        if (job->outputs & DAEMON_OUT_REGS) {
+            response[n++] = job->vm.accumulator;
+            response[n++] = job->vm.PC;
+            response[n++] = job->vm.N;
+            response[n++] = job->vm.Z;
+        }
+        if (job->outputs & DAEMON_OUT_DATA) {
+            memcpy(response + n, job->vm.memory + 0x80, 16);
+            n += 16;
+        }
+        if (job->outputs & DAEMON_OUT_MEMORY) {
+            memcpy(response + n, job->vm.memory, MEMORY_SIZE);
+            n += MEMORY_SIZE;
+        }
+        
+        // A client that went away just loses its results
+        pthread_mutex_lock(&job->conn->write_lock);
+        socket_write(job->conn->fd, response, n);
+        pthread_mutex_unlock(&job->conn->write_lock);
+        daemon_release(job->conn);
+        free(job);
+    }
+    return NULL;
+}
+
+typedef struct {
+    DaemonQueue *queue;
+    DaemonConnection *conn;
+} DaemonSession;
+
+// Read job frames from one client until it closes its side
+void *daemon_session(void *arg) {
+    DaemonSession *session = arg;
+    DaemonConnection *conn = session->conn;
+    DaemonQueue *q = session->queue;
+    SocketReader *reader = malloc(sizeof(SocketReader));
+    unsigned char header[DAEMON_REQUEST_HEADER];
+    
+    free(session);
+    if (!reader) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(1);
+    }
+    reader->fd = conn->fd;
+    reader->start = reader->end = 0;
+    for (;;) {
+        int got = socket_read(reader, header, sizeof(header));
+        if (got <= 0) {
+            break;
+        }
+        unsigned int length = header[10] | header[11] << 8;
+        if (header[0] != 'J' || length > MEMORY_SIZE) {
+            fprintf(stderr, "Error: Malformed job frame, closing connection\n");
+            break;
+        }
+        DaemonJob *job = malloc(sizeof(DaemonJob));
+        if (!job) {
+            fprintf(stderr, "Error: Out of memory\n");
+            exit(1);
+        }
+        init_vm(&job->vm);
+        if (socket_read(reader, job->vm.memory, length) <= 0) {
+            free(job);
+            break;
+        }
+        job->conn = conn;
+        job->id = get32(header + 1);
+        job->max_steps = get32(header + 5);
+        if (job->max_steps == 0) {
+            job->max_steps = q->default_steps;
+        }
+        job->outputs = header[9];
+        __atomic_add_fetch(&conn->refs, 1, __ATOMIC_RELAXED);
+        daemon_enqueue(q, job);
+    }
+    
+    // Pending jobs keep the connection open until they are answered
+    shutdown(conn->fd, SHUT_RD);
+    free(reader);
+    daemon_release(conn);
+    return NULL;
+}
+
+int open_unix_socket(const char *path, struct sockaddr_un *addr) {
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Error: Socket path too long: %s\n", path);
+        return -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot create socket\n");
+    }
+    return fd;
+}
+
+int run_daemon(const char *path, long default_steps, int worker_count) {
+    struct sockaddr_un addr;
+    DaemonQueue queue;
+    
+    int listener = open_unix_socket(path, &addr);
+    if (listener < 0) {
+        return 1;
+    }
+    unlink(path);
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 64) < 0) {
+        fprintf(stderr, "Error: Cannot listen on %s\n", path);
+        close(listener);
+        return 1;
+    }
+    
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.ready, NULL);
+    queue.head = queue.tail = NULL;
+    queue.default_steps = default_steps;
+    if (worker_count < 1) {
+        worker_count = 1;
+    }
+    for (int w = 0; w < worker_count; w++) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, daemon_worker, &queue);
+        pthread_detach(thread);
+    }
+    printf("Listening on %s with %d workers\n", path, worker_count);
+    fflush(stdout);
+    
+    for (;;) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            fprintf(stderr, "Error: accept failed on %s\n", path);
+            close(listener);
+            return 1;
+        }
+        DaemonConnection *conn = malloc(sizeof(DaemonConnection));
+        DaemonSession *session = malloc(sizeof(DaemonSession));
+        if (!conn || !session) {
+            fprintf(stderr, "Error: Out of memory\n");
+            exit(1);
+        }
+        conn->fd = fd;
+        conn->refs = 1;
+        pthread_mutex_init(&conn->write_lock, NULL);
+        session->queue = &queue;
+        session->conn = conn;
+        pthread_t thread;
+        pthread_create(&thread, NULL, daemon_session, session);
+        pthread_detach(thread);
+    }
+}
+
+// submit <socket> [-s N] <image>...: send the images to a daemon as one
+// session and print the results as JSON lines, in completion order
+int run_submit(int argc, char *argv[]) {
+    struct sockaddr_un addr;
+    unsigned int max_steps = 0;
+    int first = 3;
+    
+    if (argc < 4) {
+        fprintf(stderr, "Error: Usage: %s submit <socket> [-s N] <image>...\n", argv[0]);
+        return 1;
+    }
+    if (strcmp(argv[3], "-s") == 0 && argc > 5) {
+        max_steps = (unsigned int)atol(argv[4]);
+        first = 5;
+    }
+    int count = argc - first;
+    unsigned char *frames = malloc((size_t)count * (DAEMON_REQUEST_HEADER + MEMORY_SIZE));
+    if (!frames) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(1);
+    }
+    size_t size = 0;
+    for (int i = 0; i < count; i++) {
+        NeanderVM vm;
+        init_vm(&vm);
+        long length = read_image(&vm, argv[first + i]);
+        if (length < 0) {
+            fprintf(stderr, "Error: Cannot read file %s\n", argv[first + i]);
+            free(frames);
+            return 1;
+        }
+        unsigned char *f = frames + size;
+        f[0] = 'J';
+        put32(f + 1, i);
+        put32(f + 5, max_steps);
+        f[9] = DAEMON_OUT_REGS | DAEMON_OUT_DATA;
+        f[10] = length & 0xFF;
+        f[11] = length >> 8;
+        memcpy(f + DAEMON_REQUEST_HEADER, vm.memory, length);
+        size += DAEMON_REQUEST_HEADER + length;
+    }
+    
+    int fd = open_unix_socket(argv[2], &addr);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Error: Cannot connect to %s\n", argv[2]);
+        free(frames);
+        return 1;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (socket_write(fd, frames, size) < 0) {
+        fprintf(stderr, "Error: Cannot send jobs to %s\n", argv[2]);
+        close(fd);
+        free(frames);
+        return 1;
+    }
+    shutdown(fd, SHUT_WR);
+    
+    SocketReader *reader = malloc(sizeof(SocketReader));
+    if (!reader) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(1);
+    }
+    reader->fd = fd;
+    reader->start = reader->end = 0;
+    unsigned char response[9 + 4 + 16];
+    int received = 0;
+    while (received < count && socket_read(reader, response, sizeof(response)) > 0) {
+        unsigned int id = get32(response);
+        printf("{\"file\": ");
+        fprint_json_string(stdout, id < (unsigned int)count ? argv[first + id] : "?");
+        printf(", \"status\": \"%s\", \"steps\": %u, \"ac\": %u, \"pc\": %u, \"n\": %u, \"z\": %u, \"data\": [",
+               response[4] == DAEMON_HALTED ? "halted" : "step_limit", get32(response + 5),
+               response[9], response[10], response[11], response[12]);
+        for (int a = 0; a < 16; a++) {
+            printf(a ? ", %u" : "%u", response[13 + a]);
+        }
+        printf("]}\n");
+        received++;
+    }
+    double secs = elapsed_seconds(&start);
+    fprintf(stderr, "%d of %d jobs answered in %.3f ms (%.1f us per job)\n",
+            received, count, secs * 1e3, count ? secs * 1e6 / count : 0.0);
+    
+    close(fd);
+    free(reader);
+    free(frames);
+    return received == count ? 0 : 1;
+}
+
+void print_usage(const char *prog_name) {
+    printf("Usage: %s <program.bin> [options]\n", prog_name);
+    printf("       %s --batch <dir|manifest> [options]\n", prog_name);
+    printf("       %s replay <trace> [step]\n", prog_name);
+    printf("       %s --daemon <socket> [-s N] [-j N]\n", prog_name);
+    printf("       %s submit <socket> [-s N] <image>...\n", prog_name);
+    printf("       %s --sessions [-s N] [--quantum N]\n", prog_name);
+    printf("Images may be raw bytes, assembler output (one '0'/'1' line per byte)\n");
+    printf("or neander_converter output (0x4e03 0x5244 header); the format is detected.\n");
+    printf("Options:\n");
+    printf("  -s, --steps N     Maximum number of steps to execute (0 for unlimited)\n");
+    printf("  -v, --verbose     Print detailed execution information\n");
+    printf("  -e, --engine E    Execution engine: switch (default), threaded");
+#ifdef HAVE_JIT
+    printf(" or jit");
+#endif
+    printf("\n");
+    printf("  -b, --bench       Compare engine speed on the program and exit\n");
+    printf("  -l, --lanes FILE  Run the program once per line of FILE in SIMD lockstep;\n");
+    printf("                    each line holds \"addr value\" hex pairs patched into\n");
+    printf("                    the image. With --bench, also time and check the lanes\n");
+    printf("                    against the threaded engine\n");
+    printf("  -p, --profile FILE Profile execution counts, branches, opcodes and memory\n");
+    printf("                    traffic under the threaded engine, print the hottest\n");
+    printf("                    code and save the profile to FILE as JSON. With --batch,\n");
+    printf("                    FILE gets one JSON line per image\n");
+    printf("  -t, --timing      Report clock cycles in total and per basic block, using\n");
+    printf("                    the Neander cycle cost of each instruction\n");
+    printf("  -c, --cycles N    Stop after N clock cycles instead of a step count\n");
+    printf("                    (implies --timing)\n");
+    printf("  --trace PATH      Record every step to trace file PATH (threaded engine);\n");
+    printf("                    with --batch, PATH is a directory that receives one\n");
+    printf("                    trace per image. Inspect with: replay <trace> [step]\n");
+    printf("  -d, --debug       Interactive debugger with reverse-step and\n");
+    printf("                    reverse-continue; commands are read from stdin\n");
+    printf("  --snapshot-interval N  Steps between debugger snapshots (default %d)\n",
+           DEFAULT_SNAPSHOT_INTERVAL);
+    printf("  --break ADDR      Report every arrival at ADDR (hex); repeatable\n");
+    printf("  --watch ADDR      Report every store to ADDR (hex) with the old and new\n");
+    printf("                    value, PC and step; repeatable. Both run under the\n");
+    printf("                    threaded engine at full speed\n");
+    printf("  --daemon SOCKET   Serve jobs on Unix socket SOCKET with -j workers; -s is\n");
+    printf("                    the budget for jobs that do not set one. 'submit'\n");
+    printf("                    sends images to a running daemon\n");
+    printf("  --cache FILE      Reuse final states from result cache FILE (created if\n");
+    printf("                    missing) for plain runs and --batch, storing new ones\n");
+    printf("  --no-idioms       Interpret the compiler's multiply/divide loops step by\n");
+    printf("                    step instead of jumping to their result (threaded engine)\n");
+    printf("  --no-fuse         Dispatch LDA/STA and LDA/ADD/STA sequences one instruction\n");
+    printf("                    at a time instead of as one fused step (threaded engine)\n");
+    printf("  --sessions        Host many VMs on one thread, driven by commands on stdin\n");
+    printf("                    (-s limits each VM; type 'help' for commands)\n");
+    printf("  --quantum N       Steps a --sessions VM runs before yielding (default %d)\n",
+           DEFAULT_QUANTUM);
+    printf("  --cores N         Run N cores over one shared memory, one host thread each;\n");
+    printf("                    core c starts with c in AC (--quantum sets the round)\n");
+    printf("  --entry A,B,...   Hex start address of each core (default: image PC)\n");
+    printf("  --consistency M   bsp: stores become visible at the end of each round,\n");
+    printf("                    merged in core order (default); sc: cores take turns\n");
+    printf("  --fuzz N          Run N mutations of the image's data bytes, reporting\n");
+    printf("                    new coverage and traps (bad opcode, PC wrap, step limit)\n");
+    printf("  --fuzz-range A:B  Hex address range to mutate (default %02X:%02X; only\n",
+           FUZZ_DATA_START, FUZZ_DATA_END);
+    printf("                    the bytes in it the program reads are used)\n");
+    printf("  --seed N          Random seed for --fuzz\n");
+    printf("  --findings DIR    Write one image per distinct trap found by --fuzz to DIR\n");
+    printf("  --detect-loops    Stop with a report as soon as the machine state repeats;\n");
+    printf("                    runs without a step limit unless -s is given\n");
+    printf("  --batch PATH      Run every image in directory PATH, or listed one per\n");
+    printf("                    line in manifest PATH, across all cores\n");
+    printf("  -o, --output FILE Batch results file (JSON lines, default batch_results.jsonl)\n");
+    printf("  -j, --jobs N      Worker threads for --batch (default: one per core)\n");
+    printf("  -h, --help        Print this help message\n");
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (strcmp(argv[1], "replay") == 0) {
+        return run_replay(argc, argv);
+    }
+    if (strcmp(argv[1], "submit") == 0) {
+        return run_submit(argc, argv);
+    }
+    
+    const char *filename = NULL;
+    int max_steps = 1000;  // Default max steps
+    int steps_given = 0;
+    int verbose = 0;       // Default verbosity
+    int engine = 0;        // Default engine is the switch loop
+    int bench = 0;
+    const char *lanes_file = NULL;
+    const char *batch_source = NULL;
+    const char *output = "batch_results.jsonl";
+    int worker_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int detect_loops = 0;
+    const char *profile_output = NULL;
+    int timing = 0;
+    const char *trace_path = NULL;
+    int debug = 0;
+    unsigned char breakpoints[MEMORY_SIZE] = { 0 };
+    unsigned char watchpoints[MEMORY_SIZE] = { 0 };
+    int watching = 0;
+    const char *daemon_socket = NULL;
+    const char *cache_path = NULL;
+    long snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL;
+    long long max_cycles = 0;
+    long fuzz_runs = 0;
+    unsigned char fuzz_start = FUZZ_DATA_START;
+    unsigned char fuzz_end = FUZZ_DATA_END;
+    unsigned long long fuzz_seed = 0;
+    const char *findings_dir = NULL;
+    int sessions = 0;
+    long quantum = DEFAULT_QUANTUM;
+    int core_count = 0;
+    unsigned char entries[MAX_CORES];
+    int entry_count = 0;
+    Consistency consistency = CONSISTENCY_BSP;
+    
+    // Parse command line arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        } else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--steps") == 0) {
+            if (i + 1 < argc) {
+                max_steps = atoi(argv[i + 1]);
+                steps_given = 1;
+                i++;
+            }
+        } else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
+            verbose = 1;
+        } else if (strcmp(argv[i], "-e") == 0 || strcmp(argv[i], "--engine") == 0) {
+            if (i + 1 < argc) {
+                i++;
+                engine = -1;
+                for (int e = 0; e < ENGINE_COUNT; e++) {
+                    if (strcmp(argv[i], engines[e].name) == 0) {
+                        engine = e;
+                    }
+                }
+                if (engine < 0) {
+                    fprintf(stderr, "Error: Unknown engine %s\n", argv[i]);
+                    return 1;
+                }
+            }
+        } else if (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--bench") == 0) {
+            bench = 1;
+        } else if (strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--profile") == 0) {
+            if (i + 1 < argc) {
+                profile_output = argv[++i];
+            }
+        } else if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--timing") == 0) {
+            timing = 1;
+        } else if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--cycles") == 0) {
+            if (i + 1 < argc) {
+                max_cycles = atoll(argv[++i]);
+                timing = 1;
+            }
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            if (i + 1 < argc) {
+                trace_path = argv[++i];
+            }
+        } else if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--debug") == 0) {
+            debug = 1;
+        } else if (strcmp(argv[i], "--snapshot-interval") == 0) {
+            if (i + 1 < argc) {
+                snapshot_interval = atol(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--break") == 0 || strcmp(argv[i], "--watch") == 0) {
+            if (i + 1 < argc) {
+                unsigned char *bitmap = argv[i][2] == 'b' ? breakpoints : watchpoints;
+                bitmap[strtol(argv[++i], NULL, 16) & 0xFF] = 1;
+                watching = 1;
+            }
+        } else if (strcmp(argv[i], "--daemon") == 0) {
+            if (i + 1 < argc) {
+                daemon_socket = argv[++i];
+            }
+        } else if (strcmp(argv[i], "--cache") == 0) {
+            if (i + 1 < argc) {
+                cache_path = argv[++i];
+            }
+        } else if (strcmp(argv[i], "--no-idioms") == 0) {
+            accelerate_idioms = 0;
+        } else if (strcmp(argv[i], "--no-fuse") == 0) {
+            fuse_instructions = 0;
+        } else if (strcmp(argv[i], "--detect-loops") == 0) {
+            detect_loops = 1;
+        } else if (strcmp(argv[i], "--sessions") == 0) {
+            sessions = 1;
+        } else if (strcmp(argv[i], "--quantum") == 0) {
+            if (i + 1 < argc) {
+                quantum = atol(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--cores") == 0) {
+            if (i + 1 < argc) {
+                core_count = atoi(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--entry") == 0) {
+            if (i + 1 < argc) {
+                char *p = argv[++i];
+                entry_count = 0;
+                while (*p && entry_count < MAX_CORES) {
+                    entries[entry_count++] = strtol(p, &p, 16) & 0xFF;
+                    if (*p != ',') {
+                        break;
+                    }
+                    p++;
+                }
+            }
+        } else if (strcmp(argv[i], "--consistency") == 0) {
+            if (i + 1 < argc) {
+                i++;
+                if (strcmp(argv[i], "bsp") == 0) {
+                    consistency = CONSISTENCY_BSP;
+                } else if (strcmp(argv[i], "sc") == 0) {
+                    consistency = CONSISTENCY_SC;
+                } else {
+                    fprintf(stderr, "Error: Unknown consistency model %s\n", argv[i]);
+                    return 1;
+                }
+            }
+        } else if (strcmp(argv[i], "--fuzz") == 0) {
+            if (i + 1 < argc) {
+                fuzz_runs = atol(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--fuzz-range") == 0) {
+            if (i + 1 < argc) {
+                char *end;
+                fuzz_start = strtol(argv[++i], &end, 16) & 0xFF;
+                fuzz_end = *end == ':' ? strtol(end + 1, NULL, 16) & 0xFF : fuzz_start;
+            }
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            if (i + 1 < argc) {
+                fuzz_seed = strtoull(argv[++i], NULL, 10);
+            }
+        } else if (strcmp(argv[i], "--findings") == 0) {
+            if (i + 1 < argc) {
+                findings_dir = argv[++i];
+            }
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            if (i + 1 < argc) {
+                batch_source = argv[++i];
+            }
+        } else if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0) {
+            if (i + 1 < argc) {
+                output = argv[++i];
+            }
+        } else if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jobs") == 0) {
+            if (i + 1 < argc) {
+                worker_count = atoi(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "--lanes") == 0) {
+            if (i + 1 < argc) {
+                lanes_file = argv[++i];
+            }
+        } else if (filename == NULL) {
+            filename = argv[i];
+        }
+    }
+    
+    if (trace_path && (profile_output || timing)) {
+        fprintf(stderr, "Error: --trace cannot be combined with --profile or --timing\n");
+        return 1;
+    }
+    if (watching && (trace_path || profile_output || timing)) {
+        fprintf(stderr, "Error: --break/--watch cannot be combined with --trace, --profile or --timing\n");
+        return 1;
+    }
+    
+    // Every run either halts or repeats a state, so loop detection ends
+    // on its own
+    if (detect_loops && !steps_given) {
+        max_steps = 0;
+    }
+    
+    if (sessions) {
+        return run_sessions(max_steps, quantum);
+    }
+    if (daemon_socket) {
+        return run_daemon(daemon_socket, max_steps, worker_count);
+    }
+    if (batch_source) {
+        return run_batch(batch_source, output, max_steps, worker_count, detect_loops,
+                         profile_output, trace_path, cache_path);
+    }
+    
+    if (filename == NULL) {
+        fprintf(stderr, "Error: No input file specified\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    NeanderVM vm;
+    init_vm(&vm);
+    load_program(&vm, filename);
+    
+    if (lanes_file) {
+        return run_lockstep(&vm, lanes_file, max_steps, bench);
+    }
+    if (bench) {
+        return run_benchmark(&vm, max_steps);
+    }
+    
+    if (core_count > 0) {
+        return run_multicore(&vm, core_count, entries, entry_count, consistency, quantum, max_steps);
+    }
+    if (fuzz_runs > 0) {
+        return run_fuzzer(&vm, fuzz_runs, max_steps, fuzz_start, fuzz_end, fuzz_seed, findings_dir);
+    }
+    if (detect_loops) {
+        run_detect_loops(&vm, max_steps);
+        return 0;
+    }
+    if (debug) {
+        return run_debugger(&vm, max_steps, snapshot_interval);
+    }
+    if (trace_path) {
+        return run_traced(&vm, max_steps, trace_path);
+    }
+    if (watching) {
+        run_watched(&vm, max_steps, breakpoints, watchpoints);
+        return 0;
+    }
+    if (profile_output || timing) {
+        return run_profiled(&vm, max_steps, max_cycles, profile_output, timing);
+    }
+    
+    if (cache_path && !verbose) {
+        return run_cached(&vm, engines[engine].fn, max_steps, cache_path);
+    }
+    if (engine != 0 && verbose) {
+        fprintf(stderr, "Warning: --verbose uses the switch engine\n");
+    }
+    if (engine != 0 && !verbose) {
+        run_fast(&vm, engines[engine].fn, max_steps);
+    } else {
+        run(&vm, max_steps, verbose);
+    }
     
     return 0;
 }
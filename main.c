@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
 
 #define MAX_LINE_SIZE 1024
 #define MAX_TOKEN_SIZE 256
@@ -12,7 +13,12 @@
 
 #define INITIAL_MEMORY_ADDRESS 0x80 // 80 in hexadecimal
 #define TEMP_MEMORY_START 0xC8 // 200 in decimal (C8 in hex)
+#define MEMORY_SIZE 0x100
+#define TEMP_SLOTS (MEMORY_SIZE - TEMP_MEMORY_START) // At most 64, one bit each in temps_in_use
 #define CODE_START_ADDRESS 0x00 // Starting address for code
+// Variables and constants are numbered from here, above memory, while code
+// is generated; assign_data_addresses gives them their cells at the end
+#define VARIABLE_HANDLE_BASE 0x100
 
 // Token types
 typedef enum {
@@ -54,7 +60,7 @@ typedef enum {
 // Instruction structure
 typedef struct {
     InstructionType type;
-    int operand;    // -1 if no operand
+    int operand;    // -1 if no operand; index of the target instruction for jumps
     int address;    // Address of the instruction in the program
 } Instruction;
 
@@ -79,36 +85,117 @@ typedef struct {
     int address;
     int value;
     int initialized;
+    int constant;       // Read-only cell holding a literal
+    int known;          // Value known at this point of compilation (in known_value)
+    int known_value;
+    int stored;         // Written by emitted code
+    int read;           // Read by emitted code
 } Variable;
 
+// Syntax tree. The parser only builds the tree; generate_program walks it
+// afterwards to emit instructions. Nodes live in one growable array and
+// refer to each other by index, so building a tree costs no allocation per
+// node and a whole program stays contiguous in memory.
+#define NO_NODE UINT32_MAX
+
+typedef enum {
+    NODE_NUMBER,        // value: the literal
+    NODE_VARIABLE,      // value: symbol
+    NODE_GROUP,         // ( left )
+    NODE_NEGATE,        // - left
+    NODE_ADD,           // left + right
+    NODE_SUBTRACT,      // left - right
+    NODE_MULTIPLY,      // left * right
+    NODE_DIVIDE,        // left / right
+    NODE_INVALID,       // Unparsable factor; left: what was parsed of it, if anything
+    NODE_ASSIGN,        // symbol 'value' = left; right: next statement
+    NODE_RESULT         // RES = left
+} NodeType;
+
+typedef struct {
+    NodeType type;
+    int value;
+    uint32_t left;
+    uint32_t right;
+} Node;
+
+// Variable names seen by the parser, interned in a hash table
+typedef struct {
+    char *names;                // NUL-terminated names, back to back
+    size_t names_size;
+    size_t names_capacity;
+    uint32_t *offsets;          // Start of each symbol's name in 'names'
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *buckets;          // Symbol + 1 per slot, 0 when empty
+    uint32_t bucket_count;
+} SymbolTable;
+
+typedef struct {
+    Node *nodes;
+    uint32_t count;
+    uint32_t capacity;
+    SymbolTable symbols;
+    uint32_t first_statement;
+    uint32_t *chain;            // Scratch stack for generate_expression
+    uint32_t chain_size;
+    uint32_t chain_capacity;
+} Ast;
+
+// Peephole optimizer. Each rule can be switched off on its own; the pass
+// repeats until no enabled rule finds anything more to remove.
+//   store-load: STA x; LDA x drops the LDA
+//   dead-store: STA to a temp that no later instruction reads
+//   known-ac:   LDA x or STA x when the accumulator already equals x
+typedef enum {
+    PEEPHOLE_STORE_LOAD = 1 << 0,
+    PEEPHOLE_DEAD_STORE = 1 << 1,
+    PEEPHOLE_KNOWN_AC   = 1 << 2,
+    PEEPHOLE_ALL        = (1 << 3) - 1
+} PeepholeRule;
+
 // Compiler structure
 typedef struct {
     Variable variables[MAX_VARIABLES];
     int var_count;
     int next_address;
-    int temp_address;
+    uint64_t temps_in_use;  // Bit i set while slot TEMP_MEMORY_START + i holds a live value
+    int temp_peak;          // Most slots live at once
+    int out_of_memory;
     Instruction instructions[MAX_INSTRUCTIONS];
     int instruction_count;
+    int fold;           // Evaluate constant expressions at compile time
+    int peephole;       // Enabled PeepholeRule bits
     Lexer lexer;
+    Ast ast;
 } Compiler;
 
 // Forward declarations for recursive descent parser
-int parse_expression(Compiler *c);
-int parse_term(Compiler *c);
-int parse_factor(Compiler *c);
+uint32_t parse_expression(Compiler *c);
+uint32_t parse_term(Compiler *c);
+uint32_t parse_factor(Compiler *c);
 
 // Compiler initialization
 void init_compiler(Compiler *c) {
     c->var_count = 0;
-    c->next_address = INITIAL_MEMORY_ADDRESS;
-    c->temp_address = TEMP_MEMORY_START;
+    c->next_address = VARIABLE_HANDLE_BASE;
+    c->temps_in_use = 0;
+    c->temp_peak = 0;
+    c->out_of_memory = 0;
     c->instruction_count = 0;
+    c->fold = 1;
+    c->peephole = PEEPHOLE_ALL;
+    memset(&c->ast, 0, sizeof(c->ast));
+    c->ast.first_statement = NO_NODE;
 }
 
 // Add an instruction to the compiler
 int add_instruction(Compiler *c, InstructionType type, int operand) {
     if (c->instruction_count >= MAX_INSTRUCTIONS) {
-        fprintf(stderr, "Error: Instruction buffer overflow\n");
+        if (!c->out_of_memory) {
+            fprintf(stderr, "Error: Instruction buffer overflow\n");
+        }
+        c->out_of_memory = 1;
         return -1;
     }
     
@@ -119,6 +206,18 @@ int add_instruction(Compiler *c, InstructionType type, int operand) {
     return c->instruction_count++;
 }
 
+// Give every instruction its byte address: NOP, NOT and HLT take one
+// byte, everything else two. Returns the size of the code.
+int layout_instructions(Compiler *c) {
+    int address = CODE_START_ADDRESS;
+    for (int i = 0; i < c->instruction_count; i++) {
+        InstructionType type = c->instructions[i].type;
+        c->instructions[i].address = address;
+        address += (type == INSTR_NOP || type == INSTR_NOT || type == INSTR_HLT) ? 1 : 2;
+    }
+    return address - CODE_START_ADDRESS;
+}
+
 // Modify an existing instruction
 void modify_instruction(Compiler *c, int index, InstructionType type, int operand) {
     if (index < 0 || index >= c->instruction_count) {
@@ -150,25 +249,124 @@ int add_variable(Compiler *c, const char *name, int value, int initialized) {
         }
         return index;
     }
-    strcpy(c->variables[c->var_count].name, name);
-    c->variables[c->var_count].address = c->next_address++;
-    c->variables[c->var_count].value = value;
-    c->variables[c->var_count].initialized = initialized;
+    if (c->var_count >= MAX_VARIABLES) {
+        fprintf(stderr, "Error: Too many variables (limit %d)\n", MAX_VARIABLES);
+        exit(1);
+    }
+    Variable *v = &c->variables[c->var_count];
+    strcpy(v->name, name);
+    v->address = c->next_address++;
+    v->value = value;
+    v->initialized = initialized;
+    v->constant = 0;
+    v->known = 0;
+    v->known_value = 0;
+    v->stored = 0;
+    v->read = 0;
     return c->var_count++;
 }
 
+int add_named_constant(Compiler *c, const char *name, int value) {
+    int index = add_variable(c, name, value, 1);
+    c->variables[index].constant = 1;
+    return index;
+}
+
 int add_constant(Compiler *c, int value) {
     char constant_name[MAX_TOKEN_SIZE];
     sprintf(constant_name, "_const_%d", value);
-    int index = find_variable(c, constant_name);
-    if (index >= 0) {
-        return index;
+    return add_named_constant(c, constant_name, value);
+}
+
+// Address of a constant cell holding 'value' (0-255), reusing the named
+// constants for 0, 1 and -1
+int constant_address(Compiler *c, int value) {
+    int index;
+    value &= 0xFF;
+    if (value == 0) {
+        index = add_named_constant(c, "_zero", 0);
+    } else if (value == 1) {
+        index = add_named_constant(c, "_one", 1);
+    } else if (value == 255) {
+        index = add_named_constant(c, "_neg_one", 255);
+    } else {
+        index = add_constant(c, value);
     }
-    return add_variable(c, constant_name, value, 1);
+    return c->variables[index].address;
+}
+
+// Value at 'address' if it is a constant cell, otherwise -1
+int constant_value(Compiler *c, int address) {
+    if (!c->fold) {
+        return -1;
+    }
+    for (int i = 0; i < c->var_count; i++) {
+        if (c->variables[i].address == address) {
+            return c->variables[i].constant ? c->variables[i].value & 0xFF : -1;
+        }
+    }
+    return -1;
 }
 
+// Drop the code and temps emitted since a mark, for a subexpression whose
+// value turned out to be known, and return the constant holding it
+int fold_to_constant(Compiler *c, int instruction_mark, uint64_t temp_mark, int value) {
+    c->instruction_count = instruction_mark;
+    c->temps_in_use = temp_mark;
+    return constant_address(c, value);
+}
+
+// Quotient computed by the loop generate_division emits: it repeats while
+// divisor - remainder is not negative in 8 bits, subtracting the divisor
+// from the remainder. Returns 0 if the loop would never exit.
+int fold_division(int dividend, int divisor, int *quotient) {
+    unsigned char remainder = dividend;
+    int count = 0;
+    
+    // Only the remainder changes, so it exits within 256 iterations or never
+    for (int i = 0; i < 256; i++) {
+        if ((unsigned char)(divisor - remainder) & 0x80) {
+            *quotient = count & 0xFF;
+            return 1;
+        }
+        remainder -= divisor;
+        count++;
+    }
+    return 0;
+}
+
+// Take the lowest free temp slot. It stays live until release_temp, which
+// the code generator calls once the instruction consuming the value has
+// been emitted.
 int get_temp_address(Compiler *c) {
-    return c->temp_address++;
+    uint64_t free_slots = ~c->temps_in_use;
+    if (TEMP_SLOTS < 64) {
+        free_slots &= ((uint64_t)1 << TEMP_SLOTS) - 1;
+    }
+    if (!free_slots) {
+        if (!c->out_of_memory) {
+            fprintf(stderr, "Error: Out of temporary memory (%d slots from 0x%X)\n",
+                    TEMP_SLOTS, TEMP_MEMORY_START);
+        }
+        c->out_of_memory = 1;
+        return TEMP_MEMORY_START;
+    }
+    
+    int slot = __builtin_ctzll(free_slots);
+    c->temps_in_use |= (uint64_t)1 << slot;
+    int live = __builtin_popcountll(c->temps_in_use);
+    if (live > c->temp_peak) {
+        c->temp_peak = live;
+    }
+    return TEMP_MEMORY_START + slot;
+}
+
+// Free the slot at 'address' if it is a temp; variables and constants are
+// left alone
+void release_temp(Compiler *c, int address) {
+    if (address >= TEMP_MEMORY_START && address < MEMORY_SIZE) {
+        c->temps_in_use &= ~((uint64_t)1 << (address - TEMP_MEMORY_START));
+    }
 }
 
 // Lexer functions
@@ -234,7 +432,10 @@ Token get_next_token(Lexer *lexer) {
         int i = 0;
         while (lexer->position < lexer->length && 
                isdigit(lexer->input[lexer->position])) {
-            token.value[i++] = lexer->input[lexer->position++];
+            if (i < MAX_TOKEN_SIZE - 1) {
+                token.value[i++] = lexer->input[lexer->position];
+            }
+            lexer->position++;
         }
         token.value[i] = '\0';
         token.type = TOKEN_NUMBER;
@@ -247,7 +448,10 @@ Token get_next_token(Lexer *lexer) {
         while (lexer->position < lexer->length && 
                (isalnum(lexer->input[lexer->position]) || 
                 lexer->input[lexer->position] == '_')) {
-            token.value[i++] = lexer->input[lexer->position++];
+            if (i < MAX_TOKEN_SIZE - 1) {
+                token.value[i++] = lexer->input[lexer->position];
+            }
+            lexer->position++;
         }
         token.value[i] = '\0';
         token.type = check_keyword(token.value);
@@ -359,16 +563,16 @@ void generate_multiplication(Compiler *c, int operand1_addr, int operand2_addr,
     store_accumulator(c, counter_addr);
     
     // Jump back to start of loop
-    add_instruction(c, INSTR_JMP, loop_start * 2);  // Adjusting for correct address
+    add_instruction(c, INSTR_JMP, loop_start);
     
     // Update JZ exit address
-    modify_instruction(c, jz_instr, INSTR_JZ, c->instruction_count * 2);
+    modify_instruction(c, jz_instr, INSTR_JZ, c->instruction_count);
+    release_temp(c, counter_addr);
 }
 
 // Code generation for division
 void generate_division(Compiler *c, int dividend_addr, int divisor_addr, int result_addr) {
     int remainder_addr = get_temp_address(c);
-    int temp_addr = get_temp_address(c);
     
     // Initialize result as 0
     int zero_idx = find_variable(c, "_zero");
@@ -410,206 +614,233 @@ void generate_division(Compiler *c, int dividend_addr, int divisor_addr, int res
     store_accumulator(c, result_addr);
     
     // Jump back to start of loop
-    add_instruction(c, INSTR_JMP, loop_start * 2);
+    add_instruction(c, INSTR_JMP, loop_start);
     
     // Update JN exit address
-    modify_instruction(c, jn_instr, INSTR_JN, c->instruction_count * 2);
+    modify_instruction(c, jn_instr, INSTR_JN, c->instruction_count);
+    release_temp(c, remainder_addr);
+}
+
+void *grow_buffer(void *items, uint32_t *capacity, size_t item_size) {
+    *capacity = *capacity ? *capacity * 2 : 1024;
+    items = realloc(items, (size_t)*capacity * item_size);
+    if (!items) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(1);
+    }
+    return items;
+}
+
+uint32_t add_node(Ast *ast, NodeType type, int value, uint32_t left, uint32_t right) {
+    if (ast->count == ast->capacity) {
+        ast->nodes = grow_buffer(ast->nodes, &ast->capacity, sizeof(Node));
+    }
+    Node *node = &ast->nodes[ast->count];
+    node->type = type;
+    node->value = value;
+    node->left = left;
+    node->right = right;
+    return ast->count++;
+}
+
+const char *symbol_name(const Ast *ast, uint32_t symbol) {
+    return ast->symbols.names + ast->symbols.offsets[symbol];
+}
+
+uint32_t hash_name(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (; *name; name++) {
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    }
+    return hash;
+}
+
+// Symbol for 'name', added on first sight
+uint32_t intern_symbol(Ast *ast, const char *name) {
+    SymbolTable *t = &ast->symbols;
+    
+    if (2 * (t->count + 1) > t->bucket_count) {
+        // Rehash at half load
+        uint32_t old_count = t->bucket_count;
+        uint32_t *old = t->buckets;
+        t->bucket_count = old_count ? old_count * 2 : 256;
+        t->buckets = calloc(t->bucket_count, sizeof(uint32_t));
+        if (!t->buckets) {
+            fprintf(stderr, "Error: Out of memory\n");
+            exit(1);
+        }
+        for (uint32_t i = 0; i < old_count; i++) {
+            if (old[i]) {
+                uint32_t slot = hash_name(t->names + t->offsets[old[i] - 1]) & (t->bucket_count - 1);
+                while (t->buckets[slot]) {
+                    slot = (slot + 1) & (t->bucket_count - 1);
+                }
+                t->buckets[slot] = old[i];
+            }
+        }
+        free(old);
+    }
+    
+    uint32_t slot = hash_name(name) & (t->bucket_count - 1);
+    while (t->buckets[slot]) {
+        if (strcmp(t->names + t->offsets[t->buckets[slot] - 1], name) == 0) {
+            return t->buckets[slot] - 1;
+        }
+        slot = (slot + 1) & (t->bucket_count - 1);
+    }
+    
+    size_t length = strlen(name) + 1;
+    while (t->names_size + length > t->names_capacity) {
+        t->names_capacity = t->names_capacity ? t->names_capacity * 2 : 4096;
+        t->names = realloc(t->names, t->names_capacity);
+        if (!t->names) {
+            fprintf(stderr, "Error: Out of memory\n");
+            exit(1);
+        }
+    }
+    if (t->count == t->capacity) {
+        t->offsets = grow_buffer(t->offsets, &t->capacity, sizeof(uint32_t));
+    }
+    memcpy(t->names + t->names_size, name, length);
+    t->offsets[t->count] = t->names_size;
+    t->names_size += length;
+    t->buckets[slot] = t->count + 1;
+    return t->count++;
+}
+
+void free_ast(Ast *ast) {
+    free(ast->nodes);
+    free(ast->chain);
+    free(ast->symbols.names);
+    free(ast->symbols.offsets);
+    free(ast->symbols.buckets);
 }
 
 // Recursive descent parser
-int parse_factor(Compiler *c) {
+uint32_t parse_factor(Compiler *c) {
     Lexer *lexer = &c->lexer;
-    int result_addr = get_temp_address(c);
+    Ast *ast = &c->ast;
     
     // Handle numbers
     if (lexer->current_token.type == TOKEN_NUMBER) {
         int value = atoi(lexer->current_token.value);
-        int const_idx = add_constant(c, value);
-        load_accumulator(c, c->variables[const_idx].address);
-        store_accumulator(c, result_addr);
         advance(lexer);
+        return add_node(ast, NODE_NUMBER, value, NO_NODE, NO_NODE);
     }
     // Handle variables
-    else if (lexer->current_token.type == TOKEN_VARIABLE) {
-        char var_name[MAX_TOKEN_SIZE];
-        strcpy(var_name, lexer->current_token.value);
-        int var_idx = find_variable(c, var_name);
-        if (var_idx < 0) {
-            var_idx = add_variable(c, var_name, 0, 0);
-        }
-        load_accumulator(c, c->variables[var_idx].address);
-        store_accumulator(c, result_addr);
+    if (lexer->current_token.type == TOKEN_VARIABLE) {
+        uint32_t symbol = intern_symbol(ast, lexer->current_token.value);
         advance(lexer);
+        return add_node(ast, NODE_VARIABLE, symbol, NO_NODE, NO_NODE);
     }
     // Handle parenthesized expressions
-    else if (lexer->current_token.type == TOKEN_LPAREN) {
+    if (lexer->current_token.type == TOKEN_LPAREN) {
         advance(lexer); // Consume '('
-        int expr_result = parse_expression(c);
+        uint32_t expr = parse_expression(c);
         
         // Check for closing parenthesis
         if (lexer->current_token.type != TOKEN_RPAREN) {
             fprintf(stderr, "Error: Expected closing parenthesis\n");
-            return result_addr; // Return address to continue compilation
+            return add_node(ast, NODE_INVALID, 0, expr, NO_NODE);
         }
         advance(lexer); // Consume ')'
-        
-        // Copy expression result to result address
-        load_accumulator(c, expr_result);
-        store_accumulator(c, result_addr);
+        return add_node(ast, NODE_GROUP, 0, expr, NO_NODE);
     }
     // Handle unary minus
-    else if (lexer->current_token.type == TOKEN_MINUS) {
+    if (lexer->current_token.type == TOKEN_MINUS) {
         advance(lexer); // Consume '-'
-        
-        // Parse the factor following the minus
-        int factor_addr = parse_factor(c);
-        
-        // Calculate 2's complement to negate the value
-        load_accumulator(c, factor_addr);
-        add_instruction(c, INSTR_NOT, -1);
-        int one_idx = add_variable(c, "_one", 1, 1);
-        add_instruction(c, INSTR_ADD, c->variables[one_idx].address);
-        store_accumulator(c, result_addr);
-    }
-    else {
-        fprintf(stderr, "Error: Unexpected token in factor at position %d\n", lexer->current_token.position);
-        // Advance to try to recover from errors
-        advance(lexer);
+        uint32_t factor = parse_factor(c);
+        return add_node(ast, NODE_NEGATE, 0, factor, NO_NODE);
     }
     
-    return result_addr;
+    fprintf(stderr, "Error: Unexpected token in factor at position %d\n", lexer->current_token.position);
+    // Advance to try to recover from errors
+    advance(lexer);
+    return add_node(ast, NODE_INVALID, 0, NO_NODE, NO_NODE);
 }
 
-int parse_term(Compiler *c) {
+uint32_t parse_term(Compiler *c) {
     Lexer *lexer = &c->lexer;
     
     // Parse the first factor
-    int left_addr = parse_factor(c);
+    uint32_t left = parse_factor(c);
     
     // Process * and / operators repeatedly
     while (lexer->current_token.type == TOKEN_MULTIPLY || 
            lexer->current_token.type == TOKEN_DIVIDE) {
-        TokenType op_type = lexer->current_token.type;
+        NodeType type = lexer->current_token.type == TOKEN_MULTIPLY ? NODE_MULTIPLY : NODE_DIVIDE;
         advance(lexer); // Consume the operator
         
-        // Parse the next factor
-        int right_addr = parse_factor(c);
-        int result_addr = get_temp_address(c);
-        
-        // Generate code for the operation
-        if (op_type == TOKEN_MULTIPLY) {
-            generate_multiplication(c, left_addr, right_addr, result_addr);
-        } else { // TOKEN_DIVIDE
-            generate_division(c, left_addr, right_addr, result_addr);
-        }
-        
-        // The result of this operation becomes the left operand for the next
-        left_addr = result_addr;
+        uint32_t right = parse_factor(c);
+        left = add_node(&c->ast, type, 0, left, right);
     }
     
-    return left_addr;
+    return left;
 }
 
-int parse_expression(Compiler *c) {
+uint32_t parse_expression(Compiler *c) {
     Lexer *lexer = &c->lexer;
     
     // Parse the first term
-    int left_addr = parse_term(c);
+    uint32_t left = parse_term(c);
     
     // Process + and - operators repeatedly
     while (lexer->current_token.type == TOKEN_PLUS || 
            lexer->current_token.type == TOKEN_MINUS) {
-        TokenType op_type = lexer->current_token.type;
+        NodeType type = lexer->current_token.type == TOKEN_PLUS ? NODE_ADD : NODE_SUBTRACT;
         advance(lexer); // Consume the operator
         
-        // Parse the next term
-        int right_addr = parse_term(c);
-        int result_addr = get_temp_address(c);
-        
-        // Generate code for the operation
-        if (op_type == TOKEN_PLUS) {
-            load_accumulator(c, left_addr);
-            add_instruction(c, INSTR_ADD, right_addr);
-            store_accumulator(c, result_addr);
-        } else { // TOKEN_MINUS
-            // For subtraction, negate the second operand and add
-            load_accumulator(c, right_addr);
-            add_instruction(c, INSTR_NOT, -1);
-            int one_idx = add_variable(c, "_one", 1, 1);
-            add_instruction(c, INSTR_ADD, c->variables[one_idx].address);
-            store_accumulator(c, right_addr);
-            
-            load_accumulator(c, left_addr);
-            add_instruction(c, INSTR_ADD, right_addr);
-            store_accumulator(c, result_addr);
-        }
-        
-        // The result of this operation becomes the left operand for the next
-        left_addr = result_addr;
+        uint32_t right = parse_term(c);
+        left = add_node(&c->ast, type, 0, left, right);
     }
     
-    return left_addr;
+    return left;
 }
 
 // Parse a variable assignment
-int parse_assignment(Compiler *c) {
+uint32_t parse_assignment(Compiler *c) {
     Lexer *lexer = &c->lexer;
-    char var_name[MAX_TOKEN_SIZE];
     
     // Check for variable name
     if (lexer->current_token.type != TOKEN_VARIABLE) {
         fprintf(stderr, "Error: Expected variable name in assignment\n");
-        return -1;
+        return NO_NODE;
     }
     
-    strcpy(var_name, lexer->current_token.value);
+    uint32_t symbol = intern_symbol(&c->ast, lexer->current_token.value);
     advance(lexer); // Consume variable name
     
     // Check for equals sign
     if (lexer->current_token.type != TOKEN_EQUALS) {
         fprintf(stderr, "Error: Expected '=' in assignment\n");
-        return -1;
+        return NO_NODE;
     }
     advance(lexer); // Consume '='
     
-    // Parse the expression
-    int expr_result = parse_expression(c);
-    
-    // Store the result in the variable
-    int var_idx = add_variable(c, var_name, 0, 1);
-    int var_addr = c->variables[var_idx].address;
-    
-    load_accumulator(c, expr_result);
-    store_accumulator(c, var_addr);
-    
-    return var_addr;
+    uint32_t expr = parse_expression(c);
+    return add_node(&c->ast, NODE_ASSIGN, symbol, expr, NO_NODE);
 }
 
 // Parse the result statement
-int parse_result(Compiler *c) {
+uint32_t parse_result(Compiler *c) {
     Lexer *lexer = &c->lexer;
     
     // Check for RES keyword
     if (lexer->current_token.type != TOKEN_RES) {
         fprintf(stderr, "Error: Expected 'RES' keyword\n");
-        return -1;
+        return NO_NODE;
     }
     advance(lexer); // Consume RES
     
     // Check for equals sign
     if (lexer->current_token.type != TOKEN_EQUALS) {
         fprintf(stderr, "Error: Expected '=' after RES\n");
-        return -1;
+        return NO_NODE;
     }
     advance(lexer); // Consume '='
     
-    // Parse the expression
-    int result_addr = parse_expression(c);
-    
-    // The result is left in the accumulator
-    load_accumulator(c, result_addr);
-    
-    return result_addr;
+    uint32_t expr = parse_expression(c);
+    return add_node(&c->ast, NODE_RESULT, 0, expr, NO_NODE);
 }
 
 // Parse the program identifier
@@ -644,6 +875,16 @@ int parse_program_identifier(Compiler *c) {
     return 0;
 }
 
+// Append a statement to the program's statement list
+void link_statement(Compiler *c, uint32_t *last, uint32_t statement) {
+    if (*last == NO_NODE) {
+        c->ast.first_statement = statement;
+    } else {
+        c->ast.nodes[*last].right = statement;
+    }
+    *last = statement;
+}
+
 // Parse the entire program module
 int parse_module(Compiler *c) {
     Lexer *lexer = &c->lexer;
@@ -674,7 +915,9 @@ int parse_module(Compiler *c) {
     }
     advance(lexer); // Consume INICIO
     
-    // Parse statements until we find the RES or FIM
+    // Parse statements until we find the RES or FIM, chaining them
+    // through their 'right' links
+    uint32_t last = NO_NODE;
     while (lexer->current_token.type != TOKEN_RES && 
            lexer->current_token.type != TOKEN_FIM) {
         if (lexer->current_token.type == TOKEN_EOF) {
@@ -684,9 +927,11 @@ int parse_module(Compiler *c) {
         
         // Parse assignment statement
         if (lexer->current_token.type == TOKEN_VARIABLE) {
-            if (parse_assignment(c) < 0) {
+            uint32_t statement = parse_assignment(c);
+            if (statement == NO_NODE) {
                 return -1;
             }
+            link_statement(c, &last, statement);
         } else {
             fprintf(stderr, "Error: Expected variable assignment\n");
             advance(lexer); // Try to recover
@@ -695,9 +940,11 @@ int parse_module(Compiler *c) {
     
     // Parse result statement if present
     if (lexer->current_token.type == TOKEN_RES) {
-        if (parse_result(c) < 0) {
+        uint32_t statement = parse_result(c);
+        if (statement == NO_NODE) {
             return -1;
         }
+        link_statement(c, &last, statement);
     }
     
     // Check for FIM keyword
@@ -710,6 +957,513 @@ int parse_module(Compiler *c) {
     return 0;
 }
 
+// Code generation
+int generate_expression(Compiler *c, uint32_t index);
+
+int generate_factor(Compiler *c, uint32_t index) {
+    Node node = c->ast.nodes[index];
+    int instruction_mark = c->instruction_count;
+    uint64_t temp_mark = c->temps_in_use;
+    int result_addr;
+    
+    // Numbers and variables are used straight from their own cells. Only
+    // computed values go to a temp.
+    if (node.type == NODE_NUMBER) {
+        if (c->fold) {
+            return fold_to_constant(c, instruction_mark, temp_mark, node.value);
+        }
+        result_addr = constant_address(c, node.value);
+    } else if (node.type == NODE_VARIABLE) {
+        const char *var_name = symbol_name(&c->ast, node.value);
+        int var_idx = find_variable(c, var_name);
+        if (var_idx < 0) {
+            var_idx = add_variable(c, var_name, 0, 0);
+        }
+        if (c->fold && c->variables[var_idx].known) {
+            return fold_to_constant(c, instruction_mark, temp_mark, c->variables[var_idx].known_value);
+        }
+        c->variables[var_idx].read = 1;
+        result_addr = c->variables[var_idx].address;
+    } else if (node.type == NODE_GROUP) {
+        int expr_result = generate_expression(c, node.left);
+        int value = constant_value(c, expr_result);
+        if (value >= 0) {
+            return fold_to_constant(c, instruction_mark, temp_mark, value);
+        }
+        result_addr = expr_result;
+    } else if (node.type == NODE_NEGATE) {
+        int factor_addr = generate_factor(c, node.left);
+        int value = constant_value(c, factor_addr);
+        if (value >= 0) {
+            return fold_to_constant(c, instruction_mark, temp_mark, -value);
+        }
+        
+        // Calculate 2's complement to negate the value
+        release_temp(c, factor_addr);
+        result_addr = get_temp_address(c);
+        load_accumulator(c, factor_addr);
+        add_instruction(c, INSTR_NOT, -1);
+        int one_idx = add_variable(c, "_one", 1, 1);
+        add_instruction(c, INSTR_ADD, c->variables[one_idx].address);
+        store_accumulator(c, result_addr);
+    } else {
+        // Unclosed parenthesis: keep the inner code, leave the slot unset
+        if (node.left != NO_NODE) {
+            release_temp(c, generate_expression(c, node.left));
+        }
+        result_addr = get_temp_address(c);
+    }
+    
+    return result_addr;
+}
+
+int generate_term(Compiler *c, uint32_t index) {
+    const Node *nodes = c->ast.nodes;
+    int instruction_mark = c->instruction_count;
+    uint64_t temp_mark = c->temps_in_use;
+    
+    if (nodes[index].type != NODE_MULTIPLY && nodes[index].type != NODE_DIVIDE) {
+        return generate_factor(c, index);
+    }
+    
+    // a * b / c is ((a * b) / c): push the operators down the left spine
+    // and emit them innermost first, without recursing once per operator
+    uint32_t base = c->ast.chain_size;
+    while (nodes[index].type == NODE_MULTIPLY || nodes[index].type == NODE_DIVIDE) {
+        if (c->ast.chain_size == c->ast.chain_capacity) {
+            c->ast.chain = grow_buffer(c->ast.chain, &c->ast.chain_capacity, sizeof(uint32_t));
+        }
+        c->ast.chain[c->ast.chain_size++] = index;
+        index = nodes[index].left;
+    }
+    int left_addr = generate_factor(c, index);
+    
+    while (c->ast.chain_size > base) {
+        Node node = c->ast.nodes[c->ast.chain[--c->ast.chain_size]];
+        int right_addr = generate_factor(c, node.right);
+        int left = constant_value(c, left_addr);
+        int right = constant_value(c, right_addr);
+        int quotient;
+        
+        // The multiplication loop adds the right operand left times, so
+        // it yields the 8-bit product, and zero or one on either side
+        // decides it. The division loop is only folded when both operands
+        // are known and it exits.
+        if (node.type == NODE_MULTIPLY && left >= 0 && right >= 0) {
+            left_addr = fold_to_constant(c, instruction_mark, temp_mark, left * right);
+            continue;
+        }
+        if (node.type == NODE_MULTIPLY && (left == 0 || right == 0)) {
+            left_addr = fold_to_constant(c, instruction_mark, temp_mark, 0);
+            continue;
+        }
+        if (node.type == NODE_MULTIPLY && (left == 1 || right == 1)) {
+            left_addr = left == 1 ? right_addr : left_addr;
+            continue;
+        }
+        if (node.type == NODE_DIVIDE && left >= 0 && right >= 0 && fold_division(left, right, &quotient)) {
+            left_addr = fold_to_constant(c, instruction_mark, temp_mark, quotient);
+            continue;
+        }
+        int result_addr = get_temp_address(c);
+        
+        // Generate code for the operation. The loops read both operands
+        // until they exit, so the operands die only afterwards.
+        if (node.type == NODE_MULTIPLY) {
+            generate_multiplication(c, left_addr, right_addr, result_addr);
+        } else {
+            generate_division(c, left_addr, right_addr, result_addr);
+        }
+        release_temp(c, left_addr);
+        release_temp(c, right_addr);
+        
+        // The result of this operation becomes the left operand for the next
+        left_addr = result_addr;
+    }
+    
+    return left_addr;
+}
+
+int generate_expression(Compiler *c, uint32_t index) {
+    const Node *nodes = c->ast.nodes;
+    int instruction_mark = c->instruction_count;
+    uint64_t temp_mark = c->temps_in_use;
+    
+    if (nodes[index].type != NODE_ADD && nodes[index].type != NODE_SUBTRACT) {
+        return generate_term(c, index);
+    }
+    
+    // Same walk as generate_term, for + and -
+    uint32_t base = c->ast.chain_size;
+    while (nodes[index].type == NODE_ADD || nodes[index].type == NODE_SUBTRACT) {
+        if (c->ast.chain_size == c->ast.chain_capacity) {
+            c->ast.chain = grow_buffer(c->ast.chain, &c->ast.chain_capacity, sizeof(uint32_t));
+        }
+        c->ast.chain[c->ast.chain_size++] = index;
+        index = nodes[index].left;
+    }
+    int left_addr = generate_term(c, index);
+    
+    while (c->ast.chain_size > base) {
+        Node node = c->ast.nodes[c->ast.chain[--c->ast.chain_size]];
+        NodeType op_type = node.type;
+        int right_addr = generate_term(c, node.right);
+        int left = constant_value(c, left_addr);
+        int right = constant_value(c, right_addr);
+        
+        // A right operand just computed is still in AC
+        int right_in_ac = c->instruction_count > instruction_mark &&
+                          c->instructions[c->instruction_count - 1].type == INSTR_STA &&
+                          c->instructions[c->instruction_count - 1].operand == right_addr;
+        
+        if (left >= 0 && right >= 0) {
+            int value = op_type == NODE_ADD ? left + right : left - right;
+            left_addr = fold_to_constant(c, instruction_mark, temp_mark, value);
+            continue;
+        }
+        if (right == 0 || (op_type == NODE_ADD && left == 0)) {
+            left_addr = right == 0 ? left_addr : right_addr;
+            continue;
+        }
+        if (op_type == NODE_SUBTRACT && right >= 0) {
+            // Add the negated constant instead of negating at runtime
+            op_type = NODE_ADD;
+            right_addr = constant_address(c, -right);
+        }
+        
+        // The result is stored after both operands have been read, so it
+        // may take either operand's slot
+        release_temp(c, left_addr);
+        release_temp(c, right_addr);
+        int result_addr = get_temp_address(c);
+        
+        // Generate code for the operation. The right operand may be a
+        // variable, so subtraction negates it in AC rather than in place.
+        if (op_type == NODE_ADD && right_in_ac) {
+            // Addition commutes: add the left operand to the value in AC
+            add_instruction(c, INSTR_ADD, left_addr);
+            store_accumulator(c, result_addr);
+        } else if (op_type == NODE_ADD) {
+            load_accumulator(c, left_addr);
+            add_instruction(c, INSTR_ADD, right_addr);
+            store_accumulator(c, result_addr);
+        } else {
+            // left - right = ~right + 1 + left
+            if (!right_in_ac) {
+                load_accumulator(c, right_addr);
+            }
+            add_instruction(c, INSTR_NOT, -1);
+            int one_idx = add_variable(c, "_one", 1, 1);
+            add_instruction(c, INSTR_ADD, c->variables[one_idx].address);
+            add_instruction(c, INSTR_ADD, left_addr);
+            store_accumulator(c, result_addr);
+        }
+        
+        // The result of this operation becomes the left operand for the next
+        left_addr = result_addr;
+    }
+    
+    return left_addr;
+}
+
+void generate_assignment(Compiler *c, const Node *node) {
+    int expr_result = generate_expression(c, node->left);
+    
+    // Store the result in the variable
+    int var_idx = add_variable(c, symbol_name(&c->ast, node->value), 0, 1);
+    Variable *var = &c->variables[var_idx];
+    
+    // A known value is only recorded; materialize_variables writes it out
+    int value = constant_value(c, expr_result);
+    if (value >= 0) {
+        var->known = 1;
+        var->known_value = value;
+        return;
+    }
+    var->known = 0;
+    var->stored = 1;
+    load_accumulator(c, expr_result);
+    store_accumulator(c, var->address);
+    release_temp(c, expr_result);
+}
+
+// Give every variable whose final value was folded that value in memory:
+// as its initial data value when no emitted code touched it, otherwise
+// with an explicit store
+void materialize_variables(Compiler *c) {
+    for (int i = 0; i < c->var_count; i++) {
+        Variable *v = &c->variables[i];
+        if (!v->known) {
+            continue;
+        }
+        if (!v->stored && !v->read) {
+            v->value = v->known_value;
+        } else {
+            load_accumulator(c, constant_address(c, v->known_value));
+            store_accumulator(c, v->address);
+            v->stored = 1;
+        }
+    }
+}
+
+// Emit the code for every statement of the parsed program
+void generate_program(Compiler *c) {
+    int has_result = 0;
+    
+    for (uint32_t index = c->ast.first_statement; index != NO_NODE; index = c->ast.nodes[index].right) {
+        Node node = c->ast.nodes[index];
+        if (node.type == NODE_ASSIGN) {
+            generate_assignment(c, &node);
+        } else {
+            int result_addr = generate_expression(c, node.left);
+            materialize_variables(c);
+            
+            // The result is left in the accumulator
+            load_accumulator(c, result_addr);
+            release_temp(c, result_addr);
+            has_result = 1;
+        }
+    }
+    if (!has_result) {
+        materialize_variables(c);
+    }
+}
+
+// Peephole optimizer
+typedef struct {
+    const char *name;
+    PeepholeRule rule;
+} PeepholeRuleName;
+
+static const PeepholeRuleName peephole_rules[] = {
+    {"store-load", PEEPHOLE_STORE_LOAD},
+    {"dead-store", PEEPHOLE_DEAD_STORE},
+    {"known-ac", PEEPHOLE_KNOWN_AC}
+};
+#define PEEPHOLE_RULE_COUNT (int)(sizeof(peephole_rules) / sizeof(peephole_rules[0]))
+
+int is_jump(InstructionType type) {
+    return type == INSTR_JMP || type == INSTR_JN || type == INSTR_JZ;
+}
+
+// Instructions that read their operand from memory
+int reads_memory(InstructionType type) {
+    return type == INSTR_LDA || type == INSTR_ADD || type == INSTR_OR || type == INSTR_AND;
+}
+
+uint64_t temp_bit(int address) {
+    if (address < TEMP_MEMORY_START || address >= MEMORY_SIZE) {
+        return 0;
+    }
+    return (uint64_t)1 << (address - TEMP_MEMORY_START);
+}
+
+// Temps live after each instruction, solved backwards over the control
+// flow graph until nothing changes
+void compute_live_temps(Compiler *c, uint64_t *live_out) {
+    int count = c->instruction_count;
+    int changed = 1;
+    
+    memset(live_out, 0, count * sizeof(uint64_t));
+    while (changed) {
+        changed = 0;
+        for (int i = count - 1; i >= 0; i--) {
+            Instruction *instr = &c->instructions[i];
+            uint64_t out = 0;
+            
+            // Successors: the next instruction unless control never falls
+            // through, and the target of a jump
+            if (instr->type != INSTR_JMP && instr->type != INSTR_HLT && i + 1 < count) {
+                Instruction *next = &c->instructions[i + 1];
+                uint64_t in = live_out[i + 1];
+                if (next->type == INSTR_STA) {
+                    in &= ~temp_bit(next->operand);
+                }
+                if (reads_memory(next->type)) {
+                    in |= temp_bit(next->operand);
+                }
+                out |= in;
+            }
+            // Jumps only reach past the end when code was dropped on overflow
+            if (is_jump(instr->type) && instr->operand >= 0 && instr->operand < count) {
+                Instruction *target = &c->instructions[instr->operand];
+                uint64_t in = live_out[instr->operand];
+                if (target->type == INSTR_STA) {
+                    in &= ~temp_bit(target->operand);
+                }
+                if (reads_memory(target->type)) {
+                    in |= temp_bit(target->operand);
+                }
+                out |= in;
+            }
+            if (out != live_out[i]) {
+                live_out[i] = out;
+                changed = 1;
+            }
+        }
+    }
+}
+
+// Mark the instructions the enabled rules can remove. Returns how many.
+int mark_removable(Compiler *c, int rules, char *remove, int *removed_by_rule) {
+    uint64_t live_out[MAX_INSTRUCTIONS];
+    char is_target[MAX_INSTRUCTIONS + 1] = {0};
+    char in_ac[VARIABLE_HANDLE_BASE + MAX_VARIABLES] = {0};  // Cells known to hold the value in AC
+    int count = c->instruction_count;
+    int removed = 0;
+    
+    for (int i = 0; i < count; i++) {
+        if (is_jump(c->instructions[i].type) && c->instructions[i].operand >= 0 &&
+            c->instructions[i].operand <= count) {
+            is_target[c->instructions[i].operand] = 1;
+        }
+    }
+    if (rules & PEEPHOLE_DEAD_STORE) {
+        compute_live_temps(c, live_out);
+    }
+    
+    for (int i = 0; i < count; i++) {
+        Instruction *instr = &c->instructions[i];
+        int address = instr->operand;
+        
+        // Another path may reach a jump target with anything in AC
+        if (is_target[i]) {
+            memset(in_ac, 0, sizeof(in_ac));
+        }
+        remove[i] = 0;
+        
+        if ((rules & PEEPHOLE_STORE_LOAD) && instr->type == INSTR_LDA && i > 0 && !is_target[i] &&
+            !remove[i - 1] && c->instructions[i - 1].type == INSTR_STA &&
+            c->instructions[i - 1].operand == address) {
+            remove[i] = 1;
+            removed_by_rule[0]++;
+        } else if ((rules & PEEPHOLE_DEAD_STORE) && instr->type == INSTR_STA &&
+                   temp_bit(address) && !(live_out[i] & temp_bit(address))) {
+            remove[i] = 1;
+            removed_by_rule[1]++;
+        } else if ((rules & PEEPHOLE_KNOWN_AC) && (instr->type == INSTR_LDA || instr->type == INSTR_STA) &&
+                   in_ac[address]) {
+            remove[i] = 1;
+            removed_by_rule[2]++;
+        }
+        removed += remove[i];
+        
+        // Track which memory cells still equal AC
+        switch (instr->type) {
+            case INSTR_LDA:
+                if (!remove[i]) {
+                    memset(in_ac, 0, sizeof(in_ac));
+                    in_ac[address] = 1;
+                }
+                break;
+            case INSTR_STA:
+                // A removed store leaves the cell as it was
+                if (!remove[i]) {
+                    in_ac[address] = 1;
+                }
+                break;
+            case INSTR_ADD:
+            case INSTR_OR:
+            case INSTR_AND:
+            case INSTR_NOT:
+            case INSTR_JMP:
+            case INSTR_HLT:
+                memset(in_ac, 0, sizeof(in_ac));
+                break;
+            default:
+                break;
+        }
+    }
+    return removed;
+}
+
+// Drop the marked instructions, pointing jumps at removed instructions to
+// the next one that stays
+void compact_instructions(Compiler *c, const char *remove) {
+    int new_index[MAX_INSTRUCTIONS + 1];
+    int count = 0;
+    
+    for (int i = 0; i < c->instruction_count; i++) {
+        new_index[i] = count;
+        if (!remove[i]) {
+            c->instructions[count++] = c->instructions[i];
+        }
+    }
+    new_index[c->instruction_count] = count;
+    
+    for (int i = 0; i < count; i++) {
+        if (is_jump(c->instructions[i].type)) {
+            c->instructions[i].operand = new_index[c->instructions[i].operand];
+        }
+    }
+    c->instruction_count = count;
+}
+
+void optimize_peephole(Compiler *c) {
+    char remove[MAX_INSTRUCTIONS];
+    int removed_by_rule[PEEPHOLE_RULE_COUNT] = {0};
+    int before = c->instruction_count;
+    
+    if (!c->peephole) {
+        return;
+    }
+    while (mark_removable(c, c->peephole, remove, removed_by_rule) > 0) {
+        compact_instructions(c, remove);
+    }
+    
+    printf("Peephole: %d -> %d instructions (", before, c->instruction_count);
+    for (int r = 0; r < PEEPHOLE_RULE_COUNT; r++) {
+        printf("%s%s %d", r ? ", " : "", peephole_rules[r].name, removed_by_rule[r]);
+        if (!(c->peephole & peephole_rules[r].rule)) {
+            printf(" off");
+        }
+    }
+    printf(")\n");
+}
+
+// Give the variables their memory cells from INITIAL_MEMORY_ADDRESS on, in
+// the order they were added, and rewrite the operands that name them.
+// Constants no instruction uses any more (folded away or removed by the
+// peephole pass) get no cell. Variables always keep theirs: their final
+// values are the program's output.
+void assign_data_addresses(Compiler *c) {
+    char used[MAX_VARIABLES] = {0};
+    int address_of[MAX_VARIABLES];
+    int count = 0;
+    
+    for (int i = 0; i < c->instruction_count; i++) {
+        Instruction *instr = &c->instructions[i];
+        if (!is_jump(instr->type) && instr->operand >= VARIABLE_HANDLE_BASE) {
+            used[instr->operand - VARIABLE_HANDLE_BASE] = 1;
+        }
+    }
+    
+    c->next_address = INITIAL_MEMORY_ADDRESS;
+    for (int i = 0; i < c->var_count; i++) {
+        if (c->variables[i].constant && !used[i]) {
+            continue;
+        }
+        if (c->next_address >= TEMP_MEMORY_START) {
+            fprintf(stderr, "Error: Out of variable memory (0x%X-0x%X)\n",
+                    INITIAL_MEMORY_ADDRESS, TEMP_MEMORY_START - 1);
+            c->out_of_memory = 1;
+            return;
+        }
+        address_of[i] = c->next_address++;
+        c->variables[count] = c->variables[i];
+        c->variables[count].address = address_of[i];
+        count++;
+    }
+    c->var_count = count;
+    
+    for (int i = 0; i < c->instruction_count; i++) {
+        Instruction *instr = &c->instructions[i];
+        if (!is_jump(instr->type) && instr->operand >= VARIABLE_HANDLE_BASE) {
+            instr->operand = address_of[instr->operand - VARIABLE_HANDLE_BASE];
+        }
+    }
+}
+
 // Convert instructions to assembly code
 void generate_assembly_code(Compiler *c, FILE *output) {
     for (int i = 0; i < c->instruction_count; i++) {
@@ -738,13 +1492,13 @@ void generate_assembly_code(Compiler *c, FILE *output) {
                 fprintf(output, "NOT\n");
                 break;
             case INSTR_JMP:
-                fprintf(output, "JMP 0x%X\n", instr->operand);
+                fprintf(output, "JMP 0x%X\n", c->instructions[instr->operand].address);
                 break;
             case INSTR_JN:
-                fprintf(output, "JN 0x%X\n", instr->operand);
+                fprintf(output, "JN 0x%X\n", c->instructions[instr->operand].address);
                 break;
             case INSTR_JZ:
-                fprintf(output, "JZ 0x%X\n", instr->operand);
+                fprintf(output, "JZ 0x%X\n", c->instructions[instr->operand].address);
                 break;
             case INSTR_HLT:
                 fprintf(output, "HLT\n");
@@ -765,63 +1519,133 @@ void generate_data_section(Compiler *c, FILE *output) {
 }
 
 // Main compilation function
-void compile(const char *source_code, FILE *output) {
+int compile(const char *source_code, FILE *output, int fold, int peephole) {
     Compiler compiler;
     init_compiler(&compiler);
+    compiler.fold = fold;
+    compiler.peephole = peephole;
     
     // Add constant values
-    add_variable(&compiler, "_zero", 0, 1);
-    add_variable(&compiler, "_one", 1, 1);
-    add_variable(&compiler, "_neg_one", 255, 1); // 255 in 8 bits = -1
+    add_named_constant(&compiler, "_zero", 0);
+    add_named_constant(&compiler, "_one", 1);
+    add_named_constant(&compiler, "_neg_one", 255); // 255 in 8 bits = -1
     
     // Initialize lexer
     init_lexer(&compiler.lexer, source_code);
     advance(&compiler.lexer); // Get first token
     
-    // Parse the module
+    // Parse the module, then generate its code
     if (parse_module(&compiler) < 0) {
         fprintf(stderr, "Compilation failed due to errors\n");
-        return;
+        free_ast(&compiler.ast);
+        return -1;
     }
+    generate_program(&compiler);
+    free_ast(&compiler.ast);
     
     // Add halt instruction
     add_instruction(&compiler, INSTR_HLT, -1);
     
+    // Code dropped on overflow leaves jumps past the end; stop before
+    // anything follows them
+    if (!compiler.out_of_memory) {
+        optimize_peephole(&compiler);
+        assign_data_addresses(&compiler);
+    }
+    if (!compiler.out_of_memory) {
+        // Code runs from CODE_START_ADDRESS up to the variables
+        int code_size = layout_instructions(&compiler);
+        if (code_size > INITIAL_MEMORY_ADDRESS - CODE_START_ADDRESS) {
+            fprintf(stderr, "Error: Out of code memory (%d bytes, %d available)\n",
+                    code_size, INITIAL_MEMORY_ADDRESS - CODE_START_ADDRESS);
+            compiler.out_of_memory = 1;
+        }
+    }
+    if (compiler.out_of_memory) {
+        fprintf(stderr, "Compilation failed: program does not fit in %d bytes of memory\n", MEMORY_SIZE);
+        return -1;
+    }
+    printf("Temporaries: peak %d of %d slots\n", compiler.temp_peak, TEMP_SLOTS);
+    
     // Generate final assembly code
     generate_data_section(&compiler, output);
     fprintf(output, ".CODE\n");
     generate_assembly_code(&compiler, output);
+    return 0;
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <input_file> <output_file>\n", argv[0]);
+    int fold = 1;
+    int peephole = PEEPHOLE_ALL;
+    int first = 1;
+    
+    // --no-fold keeps every expression as runtime code; --no-peephole
+    // turns off every peephole rule, --no-<rule> a single one
+    for (; first < argc && strncmp(argv[first], "--", 2) == 0; first++) {
+        int known = 0;
+        if (strcmp(argv[first], "--no-fold") == 0) {
+            fold = 0;
+            known = 1;
+        } else if (strcmp(argv[first], "--no-peephole") == 0) {
+            peephole = 0;
+            known = 1;
+        }
+        for (int r = 0; r < PEEPHOLE_RULE_COUNT && !known; r++) {
+            if (strncmp(argv[first], "--no-", 5) == 0 && strcmp(argv[first] + 5, peephole_rules[r].name) == 0) {
+                peephole &= ~peephole_rules[r].rule;
+                known = 1;
+            }
+        }
+        if (!known) {
+            fprintf(stderr, "Error: Unknown option %s\n", argv[first]);
+            return 1;
+        }
+    }
+    if (argc - first != 2) {
+        fprintf(stderr, "Usage: %s [--no-fold] [--no-peephole | --no-store-load | --no-dead-store | --no-known-ac] <input_file> <output_file>\n", argv[0]);
         return 1;
     }
+    const char *input_path = argv[first];
+    const char *output_path = argv[first + 1];
     
-    FILE *input = fopen(argv[1], "r");
+    FILE *input = fopen(input_path, "r");
     if (!input) {
-        fprintf(stderr, "Error opening input file: %s\n", argv[1]);
+        fprintf(stderr, "Error opening input file: %s\n", input_path);
         return 1;
     }
     
-    char source_code[MAX_PROGRAM_SIZE] = {0};
-    char buffer[MAX_LINE_SIZE];
-    
-    while (fgets(buffer, MAX_LINE_SIZE, input)) {
-        strcat(source_code, buffer);
+    // Read the whole source into one buffer
+    size_t size = 0;
+    size_t capacity = MAX_PROGRAM_SIZE;
+    char *source_code = malloc(capacity);
+    size_t bytes;
+    
+    while (source_code && (bytes = fread(source_code + size, 1, capacity - size - 1, input)) > 0) {
+        size += bytes;
+        if (capacity - size == 1) {
+            capacity *= 2;
+            source_code = realloc(source_code, capacity);
+        }
     }
-    
     fclose(input);
+    if (!source_code) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return 1;
+    }
+    source_code[size] = '\0';
     
-    FILE *output = fopen(argv[2], "w");
+    FILE *output = fopen(output_path, "w");
     if (!output) {
-        fprintf(stderr, "Error opening output file: %s\n", argv[2]);
+        fprintf(stderr, "Error opening output file: %s\n", output_path);
         return 1;
     }
     
-    compile(source_code, output);
+    int status = compile(source_code, output, fold, peephole);
     fclose(output);
+    free(source_code);
+    if (status < 0) {
+        return 1;
+    }
     
     printf("Compilation completed successfully!\n");
     return 0;
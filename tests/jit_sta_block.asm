@@ -0,0 +1,69 @@
+; A 62-instruction block whose STAs must each be able to leave the
+; translated code with AC, N and Z written back; the STA to 0x0 rewrites
+; the LDA with its own opcode, so the block is translated again on every
+; pass until the JIT buffer has to be flushed
+.DATA
+0xFF 0x20
+.CODE
+LDA 0xFF
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0xF0
+STA 0x0
+JMP 0x0
@@ -0,0 +1,20 @@
+; Run with --cores 2 and --entry 0,8 or 8,0: one core counts 0x80 up to
+; 100 while the other halts at once. The count must not depend on which
+; core number halts.
+.DATA
+0x80 0x0
+0x81 0x9C
+0xFE 0x1
+.CODE
+LDA 0x80
+ADD 0xFE
+STA 0x80
+JMP 0xA
+HLT
+NOP
+LDA 0x81
+ADD 0xFE
+STA 0x81
+JZ 0x14
+JMP 0x0
+HLT